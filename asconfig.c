@@ -5,12 +5,14 @@
  */
 
 #include <gtk/gtk.h>
+#include <glib-unix.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <alsa/asoundlib.h>
 #include <errno.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
 
 /* Config */
 
@@ -31,6 +33,13 @@
 #define ASCONFIG_DEFAULT_RESAMPLER 1
 #define ASCONFIG_DEFAULT_PLAYBACK_INTERFACE 1
 #define ASCONFIG_DEFAULT_CAPTURE_INTERFACE 1
+/* dmix period and buffer sizing: the default profile from latencyProfiles below,
+ * and the buffer latency (ms) of the custom profile
+ */
+#define ASCONFIG_DEFAULT_LATENCY_PROFILE 1
+#define ASCONFIG_DEFAULT_LATENCY 20
+/* dsnoop buffer latency (ms), split into periods as for dmix */
+#define ASCONFIG_DEFAULT_CAPTURE_LATENCY 80
 
 /* Set the command to use for the streaming output
  * ASCONFIG_STREAM_INPUT_FORMAT:    output format of alsa file plugin. Can be "raw" or "wav".
@@ -50,12 +59,62 @@
  */
 #define ASCONFIG_STREAM_INPUT_FORMAT "raw"
 #define ASCONFIG_STREAM_COMMAND "| lame -r --bitwidth %b -s %r -m j -q6 --cbr -b 192 - - | /usr/local/bin/ezstream -c /path/to/config"
+
+/* Cache probed device parameters in $XDG_CACHE_HOME/asconfig so that startup
+ * does not need to open every pcm. The cache is dropped when the cards in
+ * /proc/asound/cards or a card's components change. Refresh always re-probes.
+ * Set to FALSE to probe every device on startup.
+ */
+#define ASCONFIG_PROBE_CACHE TRUE
+/* Passive probing never opens a pcm device: opening wakes HDMI codecs and USB
+ * interfaces from runtime suspend, which is slow and can cause pops. Only the
+ * ctl and /proc/asound are read; devices which are not running are shown as
+ * not probed until double-clicked. Can also be set with --passive.
+ */
+#define ASCONFIG_PASSIVE_PROBE FALSE
+/* Only enumerate the devices when scanning: a device is opened and probed when
+ * it is selected, as only one playback and one capture device are configured.
+ * Devices found in the probe cache are shown in full straight away.
+ * Set to FALSE to probe every device during the scan.
+ */
+#define ASCONFIG_LAZY_PROBE TRUE
+/* Give up on a device if opening and reading its parameters takes longer
+ * than this (milliseconds); it is shown with state "T" and scanning moves on.
+ * 0 waits forever. Can also be set with --probe-timeout.
+ */
+#define ASCONFIG_PROBE_TIMEOUT 2000
+/* Simulated pcm open time (ms) of --mock and --bench, see --mock-latency */
+#define ASCONFIG_MOCK_LATENCY 5
+/* Minimum time (ms) spent scanning at each size in --bench */
+#define ASCONFIG_BENCH_TIME 2000
+/* Scheduling jitter measurement (--jitter, Measure button): the candidate periods
+ * (jitterPeriodTimes) are timed smallest first until one is safe: its p99.9 wakeup
+ * latency, times ASCONFIG_JITTER_HEADROOM, plus ASCONFIG_JITTER_MARGIN (us) for the
+ * client's own processing, fits in the rest of a buffer of ASCONFIG_LATENCY_PERIODS
+ * periods. The candidates share ASCONFIG_JITTER_TIME ms: each is timed for
+ * ASCONFIG_JITTER_SAMPLES wakeups, or as many as the time left allows, and the max is
+ * used in place of p99.9 with fewer. Timing stops once fewer than
+ * ASCONFIG_JITTER_MIN_SAMPLES wakeups fit in the time left.
+ */
+#define ASCONFIG_JITTER_TIME 5000
+#define ASCONFIG_JITTER_SAMPLES 1000
+#define ASCONFIG_JITTER_MIN_SAMPLES 100
+#define ASCONFIG_JITTER_HEADROOM 2
+#define ASCONFIG_JITTER_MARGIN 500
+/* A new config is only written once its default pcm opens and runs: silence is played
+ * for this long (ms) in total, split across the typical client parameters, and the
+ * capture side is read for as long again
+ */
+#define ASCONFIG_VALIDATE_TIME 1000
 /* End of config */
 
 typedef struct {
    guint card;
    gchar *ID;
    gchar *name;
+   gchar *driver;
+   gchar *longname;
+   gchar *components;
 } ASCONFIG_CARD;
 
 typedef struct {
@@ -64,6 +123,16 @@ typedef struct {
    GtkWidget *resampler;
    GtkWidget *streamSwitch;
    GtkWidget *streamDefault;
+   GtkWidget *latencyProfile;
+   GtkWidget *latency;
+   GtkWidget *captureLatency;
+   GtkWidget *measureJitter;
+   GtkWidget *useTunedPeriod;
+   GtkWidget *timing;         /* Expander of the dmix and dsnoop timing options below */
+   GtkWidget *slowptr;
+   GtkWidget *hwPtrAlignment;
+   GtkWidget *tstampType;
+   GtkWidget *varPeriodsize;
 } ASCONFIG_CONTROLS;
 
 typedef struct {
@@ -71,216 +140,2735 @@ typedef struct {
    GtkWidget *captureTreeview;
 } ASCONFIG_DEVICE_VIEW;
 
+/* A background scan: shared by the scan thread and the rows it posts to the main loop */
+typedef struct {
+   gint ref;
+   GCancellable *cancellable;
+   GtkListStore *store[2]; /* Indexed by snd_pcm_stream_t, NULL for a headless scan */
+   gboolean useCache;      /* FALSE: re-probe every device, e.g. on Refresh */
+   gboolean deep;          /* FALSE: enumerate only, pcm devices are not opened */
+   gint card;              /* Scan only this card, -1 for all cards */
+   ASCONFIG_DEVICE_VIEW *view;
+   GKeyFile *cache;        /* Probe cache, shared by the card tasks under cacheLock */
+   GMutex cacheLock;
+   GHashTable *cacheChanged; /* Groups stored since the cache was loaded, see cache_save() */
+   GPtrArray *devices;     /* Headless scan collecting its results, e.g. --probe: the probed devices */
+   GMutex devicesLock;
+} ASCONFIG_SCAN;
+
+/* One probed device, handed from the scan thread to the main loop. Each row of the
+ * device lists holds one of these: the columns are rendered from it when drawn.
+ */
+typedef struct {
+   gint ref;               /* Heap copies only, see device_ref() */
+   ASCONFIG_SCAN *scan;    /* NULL once the device is in a row */
+   snd_pcm_stream_t stream;
+   gboolean probed;        /* FALSE: row is still being probed */
+   guint card;
+   guint dev;
+   const ASCONFIG_CARD *cardInfo; /* Interned by card_intern(): shared by all the card's rows */
+   gchar *devID;
+   gchar *devName;
+   gchar hwdev[64];
+   guint subdevices;
+   guint subdevicesAvail;
+   gint freeSubdevice;     /* A free subdevice, -1 if none or unknown */
+   const gchar *inUse;     /* NULL, ASCONFIG_STATE_PROBING, ASCONFIG_STATE_NOT_PROBED, "*" (busy), "E" (error) or "T" (timeout) */
+   guint min_ch, max_ch, min_sr, max_sr;
+   guint64 formats;        /* Bit snd_pcm_format_t set for each supported format, 0 if not known */
+   guint defaultRate;
+   snd_pcm_format_t defaultFormat; /* SND_PCM_FORMAT_UNKNOWN if not known */
+   guint defaultChannels;
+   gboolean running;       /* Busy devices: the defaults and running sizes are what the device is running */
+   gchar *owner;           /* Busy devices: owner pid and process name */
+   guint runningPeriodSize;
+   guint runningBufferSize;
+   GBytes *rateMatrix;     /* ASCONFIG_RATE_ENTRY array: natively supported combinations */
+   guint16 nativeRates;    /* Bit i set: standardRates[i] is supported at the default format and channels */
+   guint minPeriodSize, maxPeriodSize;  /* Frames */
+   guint minBufferSize, maxBufferSize;  /* Frames */
+   guint minPeriods, maxPeriods;
+   guint access;           /* Bit (1<<snd_pcm_access_t) set for each supported access type, 0 if not known */
+   gboolean batch;         /* The hardware pointer only moves once a period (SND_PCM_INFO_BATCH) */
+   gchar *usbSync;         /* USB devices: endpoint sync types of the altsettings */
+   gchar *sink;            /* HDMI/DP devices: connected sink's name, channels and rates */
+   gchar *chmaps;          /* Channel maps, e.g. "FL FR;FL FR RL RR FC LFE", NULL if not known */
+} ASCONFIG_DEVICE;
+
+G_STATIC_ASSERT(SND_PCM_FORMAT_LAST<64); /* ASCONFIG_DEVICE formats */
+
+/* What to write to .asoundrc: from the GUI's selections and controls, or from --generate */
+typedef struct {
+   const ASCONFIG_DEVICE *playback;
+   const ASCONFIG_DEVICE *capture; /* NULL: no capture device */
+   gint playbackInterface;         /* Index into playbackInterfaceTypes */
+   gint captureInterface;          /* Index into captureInterfaceTypes, -1 without a capture device */
+   gint resampler;                 /* Index into resamplers */
+   gboolean stream;                /* Add the stream pcm */
+   gboolean streamDefault;         /* The stream pcm is the default playback device */
+   gint latencyProfile;            /* Index into latencyProfiles: dmix period and buffer sizes */
+   guint latency;                  /* Buffer latency (ms) of the custom profile */
+   guint captureLatency;           /* dsnoop buffer latency (ms) */
+   gint slowptr;                   /* Index into slowptrModes: dmix and dsnoop timing options */
+   gint hwPtrAlignment;            /* Index into hwPtrAlignments */
+   gint tstampType;                /* Index into tstampTypes */
+   gboolean varPeriodsize;
+   guint tunedPeriodTime;          /* us: measured smallest safe period for dmix and dsnoop, 0: from the latencies */
+   gboolean stubStream;            /* The stream pcm writes to /dev/null rather than running ASCONFIG_STREAM_COMMAND */
+} ASCONFIG_CONFIG;
+
+/* --generate options as given on the command line, NULL or 0 if not given */
+typedef struct {
+   gchar *playback;
+   gchar *capture;
+   gchar *playbackIf;
+   gchar *captureIf;
+   gchar *resampler;
+   gboolean stream;
+   gboolean streamDefault;
+   gchar *latencyProfile;
+   gint latency;
+   gint captureLatency;
+   gchar *slowptr;
+   gchar *hwPtrAlignment;
+   gchar *tstampType;
+   gboolean varPeriodsize;
+   gboolean tunePeriod;
+   gboolean noValidate;
+   gchar *output;
+   gboolean force;
+} ASCONFIG_GENERATE;
+
+/* Wakeup latency distribution of one candidate period, see measure_jitter() */
+typedef struct {
+   guint periodTime;       /* us: the wakeup interval */
+   guint wakeups;
+   guint p50, p99, p999, max; /* us late */
+   gboolean safe;
+} ASCONFIG_JITTER;
+
+/* Exit codes of --generate */
+enum {
+   ASCONFIG_EXIT_OK,
+   ASCONFIG_EXIT_USAGE,            /* Invalid options */
+   ASCONFIG_EXIT_NO_DEVICE,        /* No such playback or capture device */
+   ASCONFIG_EXIT_DEVICE_UNUSABLE,  /* Busy without running parameters, failed or timed out */
+   ASCONFIG_EXIT_NO_MMAP,          /* dmix or dsnoop on a device without mmap access */
+   ASCONFIG_EXIT_EXISTS,           /* Output exists and --force was not given */
+   ASCONFIG_EXIT_WRITE,            /* Error writing the output */
+   ASCONFIG_EXIT_INVALID           /* The config's default pcm failed to open or run, see --no-validate */
+};
+
+/* Periods per buffer aimed for by the latency profiles */
+#define ASCONFIG_LATENCY_PERIODS 4
+
+/* dmix and dsnoop need one of these */
+#define ASCONFIG_ACCESS_MMAP ((1<<SND_PCM_ACCESS_MMAP_INTERLEAVED) | (1<<SND_PCM_ACCESS_MMAP_NONINTERLEAVED))
+
+/* One row of the rate matrix: the standard rates a device supports natively
+ * for a given format and channel count
+ */
+typedef struct {
+   guint8 format;          /* snd_pcm_format_t */
+   guint8 channels;
+   guint16 rates;          /* Bit i set: standardRates[i] is supported */
+} ASCONFIG_RATE_ENTRY;
+
+/* Highest channel count tested for the rate matrix */
+#define ASCONFIG_MATRIX_MAX_CHANNELS 32
+
+/* Alsa state for probing one card or pcm: each scan task and probe thread has its own */
+typedef struct {
+   gint card;              /* Card opened by card_open() */
+   snd_ctl_t *handle;
+   snd_pcm_t *pcm;
+   snd_ctl_card_info_t *info;
+   snd_pcm_info_t *pcminfo;
+   snd_pcm_hw_params_t *pars;
+   snd_pcm_format_mask_t *fmask;
+} ASCONFIG_PROBE;
+
+/* The alsa calls behind a probe, so the probe can be run against simulated hardware
+ * (see --mock). Each entry is a thin wrapper of the alsa call(s) it is named after.
+ */
+typedef struct {
+   const gchar *name;
+   gboolean cache;         /* FALSE: results are never cached */
+   gint (*card_next)(gint *card);                                    /* snd_card_next() */
+   gboolean (*card_open)(ASCONFIG_PROBE *probe, gint card, ASCONFIG_CARD *cardInfo);   /* snd_ctl_open(), snd_ctl_card_info() */
+   void (*card_close)(ASCONFIG_PROBE *probe, ASCONFIG_CARD *cardInfo);
+   gint (*pcm_next_device)(ASCONFIG_PROBE *probe, gint *dev);         /* snd_ctl_pcm_next_device() */
+   gint (*pcm_info)(ASCONFIG_PROBE *probe, gint dev, snd_pcm_stream_t stream, ASCONFIG_DEVICE *device); /* snd_ctl_pcm_info(): sets the device identity */
+   void (*probe_pcm)(ASCONFIG_PROBE *probe, ASCONFIG_DEVICE *device);   /* snd_pcm_open() and the hw_params queries */
+   void (*probe_eld)(ASCONFIG_PROBE *probe, ASCONFIG_DEVICE *device);   /* snd_ctl_elem_read() of the ELD, NULL if none */
+} ASCONFIG_BACKEND;
+
+/* Simulated hardware for the mock backend */
+typedef struct {
+   guint cards;
+   guint devices;          /* Per card, each with a playback and a capture pcm */
+   gint latency;           /* ms taken to open a pcm */
+   gint busy;              /* % of pcms which fail to open with EBUSY */
+   gint error;             /* % of pcms which fail to open with another error */
+} ASCONFIG_MOCK;
+
+#define ASCONFIG_STATE_PROBING "probing\u2026"
+#define ASCONFIG_STATE_NOT_PROBED "not probed"
+
+/* A pcm probe running under the watchdog. The probe thread may outlive the
+ * caller if the device hangs, so the job is shared and reference counted.
+ */
+typedef struct {
+   gint ref;
+   GMutex lock;
+   GCond cond;
+   gboolean done;
+   ASCONFIG_DEVICE device;
+} ASCONFIG_PROBE_JOB;
+
+/* Parameters of a running substream, from /proc/asound/cardN/pcmDs/subS/hw_params */
+typedef struct {
+   gchar format[32];
+   guint channels;
+   guint rate;
+   gulong periodSize;
+   gulong bufferSize;
+   gint ownerPID;
+} ASCONFIG_RUNNING;
+
+/* Hotplug watch on one card: its ctl is subscribed to element events, and a
+ * rescan of the card is delayed to let udev settle and to merge bursts of events
+ */
+typedef struct {
+   guint card;
+   ASCONFIG_DEVICE_VIEW *view;
+   snd_ctl_t *ctl;
+   guint fdSource;
+   guint rescanSource;
+   gboolean rescanUseCache;
+   ASCONFIG_SCAN *scan;    /* Latest rescan of the card */
+} ASCONFIG_HOTPLUG;
+
+#define ASCONFIG_HOTPLUG_DELAY 250 /* ms */
+
+/* One timed alsa call or device probe, see --trace */
+typedef struct {
+   const gchar *name;      /* The alsa call, or "probe" for the whole device */
+   gchar *device;          /* e.g. "hw:0,0 Playback", or "hw:0" for card calls */
+   gint64 start;           /* us since the trace started */
+   gint64 duration;        /* us */
+   guint tid;
+} ASCONFIG_TRACE_EVENT;
+
+/* Probe timings, shared by all scan and probe threads under lock */
+typedef struct {
+   gchar *filename;
+   gint64 origin;          /* Monotonic time the trace started */
+   GMutex lock;
+   GArray *events;         /* ASCONFIG_TRACE_EVENT */
+   GHashTable *threads;    /* GThread * -> tid */
+} ASCONFIG_TRACE;
+
+#define ASCONFIG_TRACE_CARD -1 /* Stream of a card call, which has no device */
+
+/* The device list model: one ASCONFIG_DEVICE per row */
 enum {
-   COLUMN_IN_USE,
-   COLUMN_CARD,
-   COLUMN_CARD_ID,
-   COLUMN_CARD_NAME,
    COLUMN_DEVICE,
-   COLUMN_DEVICE_ID,
-   COLUMN_DEVICE_NAME,
-   COLUMN_DEVICE_MIN_CHANNELS,
-   COLUMN_DEVICE_MAX_CHANNELS,
-   COLUMN_DEVICE_MIN_RATE,
-   COLUMN_DEVICE_MAX_RATE,
-   COLUMN_DEVICE_FORMAT,
-   COLUMN_DEVICE_ALSA_HW,
-   COLUMN_DEFAULT_RATE,
-   COLUMN_DEFAULT_FORMAT,
-   COLUMN_DEFAULT_CHANNELS,
    NUM_COLUMNS
 };
 
+/* The device list columns, rendered from the row's device by device_column_text() */
+enum {
+   VIEW_IN_USE,
+   VIEW_CARD,
+   VIEW_CARD_ID,
+   VIEW_CARD_NAME,
+   VIEW_DEVICE,
+   VIEW_DEVICE_ID,
+   VIEW_DEVICE_NAME,
+   VIEW_MIN_CHANNELS,
+   VIEW_MAX_CHANNELS,
+   VIEW_MIN_RATE,
+   VIEW_MAX_RATE,
+   VIEW_FORMATS,
+   VIEW_NATIVE_RATES,
+   VIEW_ALSA_HW,
+   VIEW_PERIOD_SIZE,
+   VIEW_BUFFER_SIZE,
+   VIEW_PERIODS,
+   VIEW_ACCESS,
+   VIEW_USB_SYNC,
+   VIEW_SINK,
+   VIEW_CHMAP,
+   VIEW_SUBDEVICES,
+   VIEW_SUBDEVICES_AVAIL,
+   VIEW_RUNNING,
+   VIEW_OWNER,
+   NUM_VIEW_COLUMNS
+};
+
 static GtkWidget *window = NULL;
 
-static snd_ctl_t *handle= NULL;
-static snd_pcm_t *pcm= NULL;
-static snd_ctl_card_info_t *info;
-static snd_pcm_info_t *pcminfo;
-static snd_pcm_hw_params_t *pars;
-static snd_pcm_format_mask_t *fmask;
 static ASCONFIG_CONTROLS asconfigControls;
+static ASCONFIG_SCAN *currentScan=NULL;
+static gboolean passiveProbe=ASCONFIG_PASSIVE_PROBE;
+static gboolean lazyProbe=ASCONFIG_LAZY_PROBE;
+static GHashTable *hotplugCards=NULL; /* card+1 -> ASCONFIG_HOTPLUG */
+static GFileMonitor *hotplugMonitor=NULL;
+static gint probeTimeout=ASCONFIG_PROBE_TIMEOUT;
+static ASCONFIG_TRACE *probeTrace=NULL; /* NULL: not tracing */
+static const ASCONFIG_BACKEND *probeBackend=NULL; /* Set in main() */
+static ASCONFIG_MOCK mockConfig={ 0, 0, ASCONFIG_MOCK_LATENCY, 0, 0 };
 static const gchar *playbackInterfaceTypes[] = { "hw", "plug", "dmix", NULL };
 static const gchar *captureInterfaceTypes[] = { "hw", "plug", "dsnoop", NULL };
+static const gchar *streamNames[] = { "Playback", "Capture" }; /* Indexed by snd_pcm_stream_t */
+static const gchar *viewHeadings[] = { "","Card number","Card ID","Card name","Device number","Device ID","Device name","Min. channels","Max. channels","Min. Rate","Max. rate","Sample formats","Native rates (kHz)","Alsa HW path","Period size","Buffer size","Periods","Access","USB sync","HDMI sink","Channel map","Subdevices","Free subdevices","Running parameters","Owner" };
+G_STATIC_ASSERT(G_N_ELEMENTS(viewHeadings)==NUM_VIEW_COLUMNS);
+static const guint standardRates[] = { 8000, 11025, 16000, 22050, 32000, 44100, 48000, 88200, 96000, 176400, 192000, 352800, 384000, 705600, 768000 };
+static const gchar *standardPositions[] = { "FL", "FR", "RL", "RR", "FC", "LFE", "SL", "SR", NULL }; /* Alsa's channel order for 2, 4, 6 and 8 channels */
 static const gchar *resamplers[] = { "speexrate", "speexrate_medium", "speexrate_best", NULL };
+static const gchar *latencyProfiles[] = { "low-latency", "balanced", "power-saving", "custom", NULL };
+static const guint latencyProfileTimes[] = { 10, 40, 200, 0 }; /* Buffer latency (ms), 0: custom */
+G_STATIC_ASSERT(G_N_ELEMENTS(latencyProfileTimes)==G_N_ELEMENTS(latencyProfiles)-1);
+static const guint jitterPeriodTimes[] = { 1000, 2000, 4000, 8000, 16000, 32000 }; /* us */
+static guint tunedPeriodTime=0; /* us: smallest safe period found by the Measure button, 0 if none */
+static const guint validateRates[] = { 44100, 48000 }; /* Typical client parameters, see validate_stream() */
+static const snd_pcm_format_t validateFormats[] = { SND_PCM_FORMAT_S16_LE, SND_PCM_FORMAT_S32_LE };
+/* dmix and dsnoop timing options: "default" leaves the option to alsa-lib, except that
+ * slowptr and hw_ptr_alignment follow the probe, see timing_options()
+ */
+static const gchar *slowptrModes[] = { "default", "yes", "no", NULL };
+static const gchar *hwPtrAlignments[] = { "default", "no", "roundup", "rounddown", "auto", NULL };
+static const gchar *tstampTypes[] = { "default", "gettimeofday", "monotonic", "monotonic_raw", NULL };
 
 static int show_actionbox(const gchar *msg, const gchar *title);
 static void show_msgbox(const gchar *msg, const gchar *title, gint type);
+static void start_scan(ASCONFIG_DEVICE_VIEW *deviceTreeview, gboolean useCache);
+static void start_device_probe(ASCONFIG_DEVICE_VIEW *deviceTreeview, snd_pcm_stream_t stream, GtkTreeIter *iter);
+static gchar *rate_list(guint16 rates);
 
-static gchar **getSampleFormats(const snd_pcm_format_mask_t *fmask) {
-   guint fmt, i=0;
-   gchar **sample_formats;
-   
-   sample_formats=malloc((SND_PCM_FORMAT_LAST+1)*sizeof(gchar*));
-   for (fmt=0; fmt <= SND_PCM_FORMAT_LAST; fmt++) {
-      if (snd_pcm_format_mask_test(fmask,(snd_pcm_format_t)fmt)) {
-         sample_formats[i]=g_strdup(snd_pcm_format_name((snd_pcm_format_t)fmt));
-         i++;
-      }
+/* Comma separated names of the formats in formats (see ASCONFIG_DEVICE) */
+static gchar *format_names(guint64 formats) {
+   GString *names=g_string_new(NULL);
+   guint fmt;
+
+   for (fmt=0; fmt<=SND_PCM_FORMAT_LAST; fmt++)
+      if (formats & ((guint64)1<<fmt))
+         g_string_append_printf(names, "%s%s", names->len ? ", " : "", snd_pcm_format_name((snd_pcm_format_t)fmt));
+   return g_string_free(names, FALSE);
+}
+
+static ASCONFIG_SCAN *scan_ref(ASCONFIG_SCAN *scan) {
+   g_atomic_int_inc(&scan->ref);
+   return scan;
+}
+
+static void scan_unref(gpointer data) {
+   ASCONFIG_SCAN *scan=data;
+
+   if (g_atomic_int_dec_and_test(&scan->ref)) {
+      g_object_unref(scan->cancellable);
+      g_clear_object(&scan->store[SND_PCM_STREAM_PLAYBACK]);
+      g_clear_object(&scan->store[SND_PCM_STREAM_CAPTURE]);
+      if (scan->cache!=NULL)
+         g_key_file_free(scan->cache);
+      g_hash_table_destroy(scan->cacheChanged);
+      g_mutex_clear(&scan->cacheLock);
+      if (scan->devices!=NULL)
+         g_ptr_array_unref(scan->devices);
+      g_mutex_clear(&scan->devicesLock);
+      g_free(scan);
+   }
+}
+
+/* The shared copy of cardInfo: every device of a card points to it rather than
+ * holding its own strings. Interned cards are never freed, like g_intern_string().
+ */
+static const ASCONFIG_CARD *card_intern(const ASCONFIG_CARD *cardInfo) {
+   static GMutex lock;
+   static GHashTable *cards=NULL; /* Identity -> ASCONFIG_CARD */
+   ASCONFIG_CARD *interned;
+   gchar *identity;
+
+   identity=g_strdup_printf("%u\n%s\n%s\n%s\n%s\n%s", cardInfo->card, cardInfo->ID, cardInfo->name, cardInfo->driver, cardInfo->longname, cardInfo->components);
+   g_mutex_lock(&lock);
+   if (cards==NULL)
+      cards=g_hash_table_new(g_str_hash, g_str_equal);
+   interned=g_hash_table_lookup(cards, identity);
+   if (interned==NULL) {
+      interned=g_new(ASCONFIG_CARD, 1);
+      interned->card=cardInfo->card;
+      interned->ID=g_strdup(cardInfo->ID);
+      interned->name=g_strdup(cardInfo->name);
+      interned->driver=g_strdup(cardInfo->driver);
+      interned->longname=g_strdup(cardInfo->longname);
+      interned->components=g_strdup(cardInfo->components);
+      g_hash_table_insert(cards, identity, interned);
+      identity=NULL;
+   }
+   g_mutex_unlock(&lock);
+   g_free(identity);
+   return interned;
+}
+
+/* A device with nothing known about it yet */
+static void device_init(ASCONFIG_DEVICE *device) {
+   memset(device, 0, sizeof(ASCONFIG_DEVICE));
+   device->freeSubdevice=-1;
+   device->defaultFormat=SND_PCM_FORMAT_UNKNOWN;
+}
+
+/* Free the probe results held by device */
+static void device_clear(ASCONFIG_DEVICE *device) {
+   device->formats=0;
+   device->defaultFormat=SND_PCM_FORMAT_UNKNOWN;
+   device->running=FALSE;
+   device->nativeRates=0;
+   g_clear_pointer(&device->owner, g_free);
+   g_clear_pointer(&device->rateMatrix, g_bytes_unref);
+   g_clear_pointer(&device->usbSync, g_free);
+   g_clear_pointer(&device->sink, g_free);
+   g_clear_pointer(&device->chmaps, g_free);
+}
+
+/* A heap device holding one reference */
+static ASCONFIG_DEVICE *device_new(void) {
+   ASCONFIG_DEVICE *device=g_new(ASCONFIG_DEVICE, 1);
+
+   device_init(device);
+   device->ref=1;
+   return device;
+}
+
+static ASCONFIG_DEVICE *device_ref(ASCONFIG_DEVICE *device) {
+   g_atomic_int_inc(&device->ref);
+   return device;
+}
+
+static void device_unref(ASCONFIG_DEVICE *device) {
+   if (g_atomic_int_dec_and_test(&device->ref)) {
+      if (device->scan!=NULL)
+         scan_unref(device->scan);
+      g_free(device->devID);
+      g_free(device->devName);
+      device_clear(device);
+      g_free(device);
+   }
+}
+
+/* Rows hold a reference to their device */
+G_DEFINE_BOXED_TYPE(ASCONFIG_DEVICE, device, device_ref, device_unref)
+
+/* The device of a row. The row keeps its reference: valid until the row is changed */
+static ASCONFIG_DEVICE *device_from_row(GtkTreeModel *model, GtkTreeIter *iter) {
+   ASCONFIG_DEVICE *device;
+
+   gtk_tree_model_get(model, iter, COLUMN_DEVICE, &device, -1);
+   device_unref(device);
+   return device;
+}
+
+/* Show a new state for a row's device, e.g. when it is probed again */
+static void row_set_in_use(GtkTreeModel *model, GtkTreeIter *iter, const gchar *inUse) {
+   GtkTreePath *path=gtk_tree_model_get_path(model, iter);
+
+   device_from_row(model, iter)->inUse=inUse;
+   gtk_tree_model_row_changed(model, path, iter);
+   gtk_tree_path_free(path);
+}
+
+static gboolean find_device_row(GtkTreeModel *model, const gchar *hwdev, GtkTreeIter *iter) {
+   gboolean valid;
+
+   for (valid=gtk_tree_model_get_iter_first(model, iter); valid; valid=gtk_tree_model_iter_next(model, iter))
+      if (strcmp(device_from_row(model, iter)->hwdev, hwdev)==0)
+         return TRUE;
+   return FALSE;
+}
+
+/* Remove a card's rows from store: the selection is kept unless it was on the card */
+static void remove_card_rows(GtkListStore *store, guint card) {
+   GtkTreeIter iter;
+   gboolean valid;
+
+   valid=gtk_tree_model_get_iter_first(GTK_TREE_MODEL(store), &iter);
+   while (valid) {
+      if (device_from_row(GTK_TREE_MODEL(store), &iter)->card==card)
+         valid=gtk_list_store_remove(store, &iter);
+      else
+         valid=gtk_tree_model_iter_next(GTK_TREE_MODEL(store), &iter);
+   }
+}
+
+/* Position of the first row after card, dev: keeps rows from parallel card scans in order */
+static gint device_row_position(GtkTreeModel *model, guint card, guint dev) {
+   GtkTreeIter iter;
+   gboolean valid;
+   ASCONFIG_DEVICE *row;
+   gint position=0;
+
+   for (valid=gtk_tree_model_get_iter_first(model, &iter); valid; valid=gtk_tree_model_iter_next(model, &iter)) {
+      row=device_from_row(model, &iter);
+      if (row->card>card || (row->card==card && row->dev>dev))
+         break;
+      position++;
    }
-   sample_formats[i]=NULL;
-   return sample_formats;
+   return position;
 }
 
-static void free_sample_formats(gchar **sample_formats) {
+/* The channel positions of the map for channels from chmaps (see ASCONFIG_DEVICE),
+ * or NULL if not known. Free with g_strfreev()
+ */
+static gchar **chmap_positions(const gchar *chmaps, guint channels) {
+   gchar **maps, **positions=NULL;
    guint i;
-   
-   for (i=0; sample_formats[i]!=NULL; i++)
-      free(sample_formats[i]);
-   
-   free(sample_formats);
+
+   if (chmaps==NULL)
+      return NULL;
+   maps=g_strsplit(chmaps, ";", -1);
+   for (i=0; maps[i]!=NULL && positions==NULL; i++) {
+      positions=g_strsplit(maps[i], " ", -1);
+      if (g_strv_length(positions)!=channels)
+         g_clear_pointer(&positions, g_strfreev);
+   }
+   g_strfreev(maps);
+   return positions;
 }
-/* Stream is SND_PCM_STREAM_PLAYBACK or SND_PCM_STREAM_CAPTURE */
-static void scancards(snd_pcm_stream_t stream, GtkListStore *store)
-{
-   gchar hwdev[64];
-   gchar defaultFormat[64];
-   guint min_sr, max_sr, min_ch, max_ch;
-   guint defaultRate, defaultChannels;
-   gint card, err, dev, direction;
-   ASCONFIG_CARD cardInfo;
+
+/* Comma separated names of the access types in access (see ASCONFIG_DEVICE) */
+static gchar *access_names(guint access) {
+   GString *names=g_string_new(NULL);
+   guint i;
+
+   for (i=0; i<=SND_PCM_ACCESS_LAST; i++)
+      if (access & (1<<i))
+         g_string_append_printf(names, "%s%s", names->len ? ", " : "", snd_pcm_access_name((snd_pcm_access_t)i));
+   return g_string_free(names, FALSE);
+}
+
+/* The text of a device list column, NULL if not known. Free with g_free() */
+static gchar *device_column_text(const ASCONFIG_DEVICE *device, guint column) {
+   gchar **positions, *text;
+
+   switch (column) {
+      case VIEW_IN_USE:             return g_strdup(device->inUse);
+      case VIEW_CARD:               return g_strdup_printf("%u", device->card);
+      case VIEW_CARD_ID:            return device->cardInfo ? g_strdup(device->cardInfo->ID) : NULL;
+      case VIEW_CARD_NAME:          return device->cardInfo ? g_strdup(device->cardInfo->name) : NULL;
+      case VIEW_DEVICE:             return g_strdup_printf("%u", device->dev);
+      case VIEW_DEVICE_ID:          return g_strdup(device->devID);
+      case VIEW_DEVICE_NAME:        return g_strdup(device->devName);
+      case VIEW_ALSA_HW:            return g_strdup(device->hwdev);
+      case VIEW_SINK:               return g_strdup(device->sink);
+      case VIEW_SUBDEVICES:         return g_strdup_printf("%u", device->subdevices);
+      case VIEW_SUBDEVICES_AVAIL:   return g_strdup_printf("%u", device->subdevicesAvail);
+      case VIEW_OWNER:              return g_strdup(device->owner);
+      case VIEW_RUNNING:
+         if ( ! device->running)
+            return NULL;
+         return g_strdup_printf("%u Hz, %s, %u ch, period %u, buffer %u", device->defaultRate,
+                                 device->defaultFormat!=SND_PCM_FORMAT_UNKNOWN ? snd_pcm_format_name(device->defaultFormat) : "?",
+                                 device->defaultChannels, device->runningPeriodSize, device->runningBufferSize);
+   }
+
+   if (device->formats==0) /* Not known for failed or unprobed devices, or busy devices missing from the cache */
+      return NULL;
+   switch (column) {
+      case VIEW_MIN_CHANNELS:       return g_strdup_printf("%u", device->min_ch);
+      case VIEW_MAX_CHANNELS:       return g_strdup_printf("%u", device->max_ch);
+      case VIEW_MIN_RATE:           return g_strdup_printf("%u", device->min_sr);
+      case VIEW_MAX_RATE:           return g_strdup_printf("%u", device->max_sr);
+      case VIEW_FORMATS:            return format_names(device->formats);
+      case VIEW_NATIVE_RATES:       return rate_list(device->nativeRates);
+      case VIEW_PERIOD_SIZE:        return g_strdup_printf("%u-%u", device->minPeriodSize, device->maxPeriodSize);
+      case VIEW_BUFFER_SIZE:        return g_strdup_printf("%u-%u", device->minBufferSize, device->maxBufferSize);
+      case VIEW_PERIODS:            return g_strdup_printf("%u-%u", device->minPeriods, device->maxPeriods);
+      case VIEW_ACCESS:             return access_names(device->access);
+      case VIEW_USB_SYNC:           return g_strdup(device->usbSync);
+      case VIEW_CHMAP:
+         positions=chmap_positions(device->chmaps, device->defaultChannels);
+         text=positions ? g_strjoinv(" ", positions) : NULL;
+         g_strfreev(positions);
+         return text;
+   }
+   return NULL;
+}
+
+/* Runs on the main loop: insert a new row in the probing state, or fill in the probe results
+ * The row takes a reference to device.
+ */
+static gboolean device_ready(gpointer data) {
+   ASCONFIG_DEVICE *device=data;
+   GtkListStore *store=device->scan->store[device->stream];
+   ASCONFIG_DEVICE_VIEW *view=device->scan->view;
    GtkTreeIter iter;
-   gchar **sample_formats;
-   gchar *sampleFormatsCSV;
-   gchar playback[16]="Playback";
-   gchar capture[16]="Capture";
-   gchar *streamType;
-
-   if (stream==SND_PCM_STREAM_PLAYBACK)
-      streamType=playback;
-   else
-      streamType=capture;
+   GtkWidget *treeview;
 
-   card=-1; /* Return first available card */
+   if (g_cancellable_is_cancelled(device->scan->cancellable))
+      return G_SOURCE_REMOVE; /* Result from an abandoned scan: store has already been cleared */
 
-   while (snd_card_next(&card)==0 && card>=0) {
-      snprintf(hwdev, 64, "hw:%d", card);
-      err=snd_ctl_open(&handle, hwdev, 0);
-      if (err!=0) {
-         g_warning("%s: Error opening card %s: %s", streamType, hwdev, strerror(-err));
-         continue;
+   if (device->probed==FALSE) {
+      /* A rescanned card updates its rows in place, so the selection and the last results are kept */
+      if (find_device_row(GTK_TREE_MODEL(store), device->hwdev, &iter)) {
+         row_set_in_use(GTK_TREE_MODEL(store), &iter, ASCONFIG_STATE_PROBING);
+         return G_SOURCE_REMOVE;
       }
-      err=snd_ctl_card_info(handle, info);
-      if (err!=0) {
-         g_warning("%s: Error opening card %s: %s", streamType, hwdev, strerror(-err));
-         snd_ctl_close(handle);
-         continue;
+      gtk_list_store_insert(store, &iter, device_row_position(GTK_TREE_MODEL(store), device->card, device->dev));
+      device->inUse=ASCONFIG_STATE_PROBING;
+   }
+   else if ( ! find_device_row(GTK_TREE_MODEL(store), device->hwdev, &iter))
+      return G_SOURCE_REMOVE;
+
+   g_clear_pointer(&device->scan, scan_unref); /* The row must not keep the scan, and so the store, alive */
+   gtk_list_store_set(store, &iter, COLUMN_DEVICE, device, -1);
+
+   /* A device which was selected while it was being enumerated */
+   if ( ! passiveProbe && g_strcmp0(device->inUse, ASCONFIG_STATE_NOT_PROBED)==0) {
+      treeview=(device->stream==SND_PCM_STREAM_PLAYBACK) ? view->playbackTreeview : view->captureTreeview;
+      if (gtk_tree_selection_iter_is_selected(gtk_tree_view_get_selection(GTK_TREE_VIEW(treeview)), &iter))
+         start_device_probe(view, device->stream, &iter);
+   }
+   return G_SOURCE_REMOVE;
+}
+
+/* A heap copy of device holding one reference, not tied to any scan */
+static ASCONFIG_DEVICE *device_copy(const ASCONFIG_DEVICE *device) {
+   ASCONFIG_DEVICE *copy=g_new(ASCONFIG_DEVICE, 1);
+
+   *copy=*device;
+   copy->ref=1;
+   copy->scan=NULL;
+   copy->devID=g_strdup(device->devID);
+   copy->devName=g_strdup(device->devName);
+   copy->owner=g_strdup(device->owner);
+   copy->rateMatrix=device->rateMatrix ? g_bytes_ref(device->rateMatrix) : NULL;
+   copy->usbSync=g_strdup(device->usbSync);
+   copy->sink=g_strdup(device->sink);
+   copy->chmaps=g_strdup(device->chmaps);
+   return copy;
+}
+
+/* Hand a copy of the device to the main loop, or to a headless scan's results; the scan thread keeps its own */
+static void post_device(ASCONFIG_DEVICE *device) {
+   ASCONFIG_SCAN *scan=device->scan;
+   ASCONFIG_DEVICE *copy;
+
+   if (scan->devices!=NULL) {
+      if (device->probed) { /* Only the results, not the probing state */
+         g_mutex_lock(&scan->devicesLock);
+         g_ptr_array_add(scan->devices, device_copy(device));
+         g_mutex_unlock(&scan->devicesLock);
       }
-      cardInfo.card=card;
-      cardInfo.ID=g_strdup(snd_ctl_card_info_get_id(info));
-      cardInfo.name=g_strdup(snd_ctl_card_info_get_name(info));
-      
-      dev=-1;  /* Return first available device */
-
-      while (snd_ctl_pcm_next_device(handle, &dev)==0 && dev>=0) {
-         snprintf(hwdev, 64, "hw:%d,%d", card, dev);
-         snd_pcm_info_set_device(pcminfo, dev);
-         snd_pcm_info_set_subdevice(pcminfo, 0);
-         snd_pcm_info_set_stream(pcminfo, stream);
-         err=snd_ctl_pcm_info(handle, pcminfo);
-         if (err!=0) {
-            g_warning("%s: Error opening device %s: %s", streamType, hwdev, strerror(-err));
+      return;
+   }
+   if (scan->store[device->stream]==NULL)
+      return; /* Headless scan, e.g. --bench */
+   copy=device_copy(device);
+   copy->scan=scan_ref(scan);
+   g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, device_ready, copy, (GDestroyNotify)device_unref);
+}
+
+/* Probe tracing
+ * With --trace=FILE each alsa call made while probing is timed, together with a span
+ * for each device, and written as Chrome trace-event JSON (chrome://tracing or Perfetto)
+ * with a per-device summary under "asconfigSummary". Calls are timed as
+ *    start=trace_begin(); err=snd_...(); trace_end(start, "snd_...", hwdev, stream);
+ * which is only a pointer test when not tracing.
+ */
+/* filename: NULL to only keep the trace in memory, e.g. for --bench */
+static ASCONFIG_TRACE *trace_new(const gchar *filename) {
+   ASCONFIG_TRACE *trace=g_new0(ASCONFIG_TRACE, 1);
+
+   trace->filename=g_strdup(filename);
+   trace->origin=g_get_monotonic_time();
+   g_mutex_init(&trace->lock);
+   trace->events=g_array_new(FALSE, FALSE, sizeof(ASCONFIG_TRACE_EVENT));
+   trace->threads=g_hash_table_new(g_direct_hash, g_direct_equal);
+   return trace;
+}
+
+static gint64 trace_begin(void) {
+   return probeTrace ? g_get_monotonic_time() : 0;
+}
+
+/* Record the call name started at start on hwdev; stream is ASCONFIG_TRACE_CARD for card calls */
+static void trace_end(gint64 start, const gchar *name, const gchar *hwdev, gint stream) {
+   ASCONFIG_TRACE_EVENT event;
+   gint64 end;
+   gpointer tid;
+
+   if (probeTrace==NULL)
+      return;
+   end=g_get_monotonic_time();
+   event.name=name;
+   event.device=(stream==ASCONFIG_TRACE_CARD) ? g_strdup(hwdev) : g_strdup_printf("%s %s", hwdev, streamNames[stream]);
+   event.start=start-probeTrace->origin;
+   event.duration=end-start;
+
+   g_mutex_lock(&probeTrace->lock);
+   tid=g_hash_table_lookup(probeTrace->threads, g_thread_self());
+   if (tid==NULL) {
+      tid=GUINT_TO_POINTER(g_hash_table_size(probeTrace->threads)+1);
+      g_hash_table_insert(probeTrace->threads, g_thread_self(), tid);
+   }
+   event.tid=GPOINTER_TO_UINT(tid);
+   g_array_append_val(probeTrace->events, event);
+   g_mutex_unlock(&probeTrace->lock);
+}
+
+/* Per-device totals: the probe span and, for each alsa call, the count and time spent */
+static void trace_summary(ASCONFIG_TRACE *trace, GString *json) {
+   GHashTable *devices, *calls;
+   GList *names, *name, *callNames, *call;
+   ASCONFIG_TRACE_EVENT *event;
+   gint64 *total;
+   guint i;
+
+   devices=g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)g_hash_table_destroy);
+   for (i=0; i<trace->events->len; i++) {
+      event=&g_array_index(trace->events, ASCONFIG_TRACE_EVENT, i);
+      calls=g_hash_table_lookup(devices, event->device);
+      if (calls==NULL) {
+         calls=g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+         g_hash_table_insert(devices, event->device, calls);
+      }
+      total=g_hash_table_lookup(calls, event->name);
+      if (total==NULL) {
+         total=g_new0(gint64, 2); /* Count, us */
+         g_hash_table_insert(calls, (gpointer)event->name, total);
+      }
+      total[0]++;
+      total[1]+=event->duration;
+   }
+
+   names=g_list_sort(g_hash_table_get_keys(devices), (GCompareFunc)strcmp);
+   for (name=names; name!=NULL; name=name->next) {
+      calls=g_hash_table_lookup(devices, name->data);
+      total=g_hash_table_lookup(calls, "probe");
+      g_string_append_printf(json, "%s\n  { \"device\": \"%s\", \"probe_us\": %" G_GINT64_FORMAT ", \"calls\": {",
+                              name==names ? "" : ",", (gchar *)name->data, total ? total[1] : 0);
+      callNames=g_list_sort(g_hash_table_get_keys(calls), (GCompareFunc)strcmp);
+      for (call=callNames; call!=NULL; call=call->next) {
+         if (strcmp(call->data, "probe")==0)
             continue;
+         total=g_hash_table_lookup(calls, call->data);
+         g_string_append_printf(json, "%s \"%s\": { \"count\": %" G_GINT64_FORMAT ", \"us\": %" G_GINT64_FORMAT " }",
+                                 json->str[json->len-1]=='{' ? "" : ",", (gchar *)call->data, total[0], total[1]);
+      }
+      g_list_free(callNames);
+      g_string_append(json, " } }");
+   }
+   g_list_free(names);
+   g_hash_table_destroy(devices);
+}
+
+/* Write the trace so far: it is rewritten after each full scan and on exit */
+static void trace_save(ASCONFIG_TRACE *trace) {
+   GString *json=g_string_new("{ \"displayTimeUnit\": \"ms\",\n\"traceEvents\": [");
+   ASCONFIG_TRACE_EVENT *event;
+   GError *error=NULL;
+   guint i;
+
+   g_mutex_lock(&trace->lock);
+   for (i=0; i<trace->events->len; i++) {
+      event=&g_array_index(trace->events, ASCONFIG_TRACE_EVENT, i);
+      g_string_append_printf(json, "%s\n  { \"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %" G_GINT64_FORMAT ", \"dur\": %" G_GINT64_FORMAT ", \"args\": { \"device\": \"%s\" } }",
+                              i ? "," : "", event->name, strcmp(event->name, "probe")==0 ? "device" : "alsa", event->tid, event->start, event->duration, event->device);
+   }
+   g_string_append(json, "\n],\n\"asconfigSummary\": [");
+   trace_summary(trace, json);
+   g_mutex_unlock(&trace->lock);
+   g_string_append(json, "\n]\n}\n");
+
+   if ( ! g_file_set_contents(trace->filename, json->str, json->len, &error)) {
+      g_warning("Error writing trace %s: %s", trace->filename, error->message);
+      g_error_free(error);
+   }
+   g_string_free(json, TRUE);
+}
+
+/* Probe cache
+ * One group per device, named by a checksum of the card identity, device and direction.
+ * The [asconfig] group holds a checksum of /proc/asound/cards: if the cards change the
+ * whole cache is discarded.
+ */
+static gchar *cache_filename(void) {
+   return g_build_filename(g_get_user_cache_dir(), "asconfig", "probe.cache", NULL);
+}
+
+static GKeyFile *cache_load(void) {
+   GKeyFile *cache=g_key_file_new();
+   gchar *filename=cache_filename();
+   gchar *cards=NULL, *cardsChecksum, *cachedChecksum=NULL;
+
+   if ( ! g_file_get_contents("/proc/asound/cards", &cards, NULL, NULL))
+      cards=g_strdup("");
+   cardsChecksum=g_compute_checksum_for_string(G_CHECKSUM_SHA1, cards, -1);
+
+   if (g_key_file_load_from_file(cache, filename, G_KEY_FILE_NONE, NULL))
+      cachedChecksum=g_key_file_get_string(cache, "asconfig", "cards", NULL);
+   if (g_strcmp0(cachedChecksum, cardsChecksum)!=0) { /* Cards changed: start again */
+      g_key_file_free(cache);
+      cache=g_key_file_new();
+      g_key_file_set_string(cache, "asconfig", "cards", cardsChecksum);
+   }
+
+   g_free(cachedChecksum);
+   g_free(cardsChecksum);
+   g_free(cards);
+   g_free(filename);
+   return cache;
+}
+
+/* Write the groups the scan has stored into the cache file. Scans and single device probes
+ * run at the same time, so the file is reloaded and merged under a lock rather than
+ * overwritten with the scan's copy, which would lose what the others saved since.
+ */
+static void cache_save(ASCONFIG_SCAN *scan) {
+   static GMutex lock;
+   gchar *filename=cache_filename();
+   gchar *dirname=g_path_get_dirname(filename);
+   GKeyFile *cache;
+   GHashTableIter changed;
+   gchar *group, **keys, *value;
+   gsize i;
+   GError *error=NULL;
+
+   g_mutex_lock(&lock);
+   cache=cache_load();
+   g_mutex_lock(&scan->cacheLock);
+   g_hash_table_iter_init(&changed, scan->cacheChanged);
+   while (g_hash_table_iter_next(&changed, (gpointer *)&group, NULL)) {
+      g_key_file_remove_group(cache, group, NULL);
+      keys=g_key_file_get_keys(scan->cache, group, NULL, NULL);
+      for (i=0; keys!=NULL && keys[i]!=NULL; i++) {
+         value=g_key_file_get_value(scan->cache, group, keys[i], NULL);
+         g_key_file_set_value(cache, group, keys[i], value);
+         g_free(value);
+      }
+      g_strfreev(keys);
+   }
+   g_hash_table_remove_all(scan->cacheChanged);
+   g_mutex_unlock(&scan->cacheLock);
+
+   g_mkdir_with_parents(dirname, 0700);
+   if ( ! g_key_file_save_to_file(cache, filename, &error)) {
+      g_warning("Error writing probe cache %s: %s", filename, error->message);
+      g_error_free(error);
+   }
+   g_mutex_unlock(&lock);
+   g_key_file_free(cache);
+   g_free(dirname);
+   g_free(filename);
+}
+
+static gchar *cache_group(const ASCONFIG_CARD *cardInfo, const ASCONFIG_DEVICE *device) {
+   gchar *identity, *group;
+
+   identity=g_strdup_printf("%s\n%s\n%s\n%u\n%s", cardInfo->ID, cardInfo->driver, cardInfo->longname, device->dev, streamNames[device->stream]);
+   group=g_compute_checksum_for_string(G_CHECKSUM_SHA1, identity, -1);
+   g_free(identity);
+   return group;
+}
+
+/* Fill device from the cache. Returns FALSE if the device is not cached */
+static gboolean cache_lookup(ASCONFIG_SCAN *scan, const ASCONFIG_CARD *cardInfo, ASCONFIG_DEVICE *device) {
+   gchar *group=cache_group(cardInfo, device);
+   gchar *components, *defaultFormat;
+   gboolean found=FALSE;
+   gint *packed;
+   gsize n, i;
+   ASCONFIG_RATE_ENTRY *matrix;
+
+   g_mutex_lock(&scan->cacheLock);
+   components=g_key_file_get_string(scan->cache, group, "components", NULL);
+   if (components!=NULL && g_strcmp0(components, cardInfo->components)==0) {
+      device->min_ch=g_key_file_get_integer(scan->cache, group, "min_channels", NULL);
+      device->max_ch=g_key_file_get_integer(scan->cache, group, "max_channels", NULL);
+      device->min_sr=g_key_file_get_integer(scan->cache, group, "min_rate", NULL);
+      device->max_sr=g_key_file_get_integer(scan->cache, group, "max_rate", NULL);
+      device->formats=g_key_file_get_uint64(scan->cache, group, "format_mask", NULL);
+      device->defaultRate=g_key_file_get_integer(scan->cache, group, "default_rate", NULL);
+      defaultFormat=g_key_file_get_string(scan->cache, group, "default_format", NULL);
+      device->defaultFormat=defaultFormat ? snd_pcm_format_value(defaultFormat) : SND_PCM_FORMAT_UNKNOWN;
+      g_free(defaultFormat);
+      device->defaultChannels=g_key_file_get_integer(scan->cache, group, "default_channels", NULL);
+      device->nativeRates=g_key_file_get_integer(scan->cache, group, "native_rate_mask", NULL);
+      packed=g_key_file_get_integer_list(scan->cache, group, "rate_matrix", &n, NULL);
+      matrix=g_new0(ASCONFIG_RATE_ENTRY, n);
+      for (i=0; i<n; i++) {
+         matrix[i].format=(packed[i]>>24) & 0xff;
+         matrix[i].channels=(packed[i]>>16) & 0xff;
+         matrix[i].rates=packed[i] & 0xffff;
+      }
+      device->rateMatrix=g_bytes_new_take(matrix, n*sizeof(ASCONFIG_RATE_ENTRY));
+      g_free(packed);
+      device->minPeriodSize=g_key_file_get_integer(scan->cache, group, "min_period_size", NULL);
+      device->maxPeriodSize=g_key_file_get_integer(scan->cache, group, "max_period_size", NULL);
+      device->minBufferSize=g_key_file_get_integer(scan->cache, group, "min_buffer_size", NULL);
+      device->maxBufferSize=g_key_file_get_integer(scan->cache, group, "max_buffer_size", NULL);
+      device->minPeriods=g_key_file_get_integer(scan->cache, group, "min_periods", NULL);
+      device->maxPeriods=g_key_file_get_integer(scan->cache, group, "max_periods", NULL);
+      device->access=g_key_file_get_integer(scan->cache, group, "access", NULL);
+      device->batch=g_key_file_get_boolean(scan->cache, group, "batch", NULL);
+      device->usbSync=g_key_file_get_string(scan->cache, group, "usb_sync", NULL);
+      device->chmaps=g_key_file_get_string(scan->cache, group, "chmaps", NULL);
+      found=(device->formats!=0 && device->defaultFormat!=SND_PCM_FORMAT_UNKNOWN && device->access!=0); /* No format mask or access: written by an older version */
+      if ( ! found)
+         device_clear(device);
+   }
+   g_mutex_unlock(&scan->cacheLock);
+
+   g_free(components);
+   g_free(group);
+   return found;
+}
+
+static void cache_store(ASCONFIG_SCAN *scan, const ASCONFIG_CARD *cardInfo, const ASCONFIG_DEVICE *device) {
+   gchar *group=cache_group(cardInfo, device);
+   const ASCONFIG_RATE_ENTRY *matrix;
+   gint *packed;
+   gsize size, n, i;
+
+   g_mutex_lock(&scan->cacheLock);
+   g_key_file_set_string(scan->cache, group, "components", cardInfo->components);
+   g_key_file_set_integer(scan->cache, group, "min_channels", device->min_ch);
+   g_key_file_set_integer(scan->cache, group, "max_channels", device->max_ch);
+   g_key_file_set_integer(scan->cache, group, "min_rate", device->min_sr);
+   g_key_file_set_integer(scan->cache, group, "max_rate", device->max_sr);
+   g_key_file_set_uint64(scan->cache, group, "format_mask", device->formats);
+   g_key_file_set_integer(scan->cache, group, "default_rate", device->defaultRate);
+   g_key_file_set_string(scan->cache, group, "default_format", snd_pcm_format_name(device->defaultFormat));
+   g_key_file_set_integer(scan->cache, group, "default_channels", device->defaultChannels);
+   g_key_file_set_integer(scan->cache, group, "native_rate_mask", device->nativeRates);
+   /* Rate matrix entries packed as format<<24 | channels<<16 | rates */
+   matrix=g_bytes_get_data(device->rateMatrix, &size);
+   n=size/sizeof(ASCONFIG_RATE_ENTRY);
+   packed=g_new0(gint, n);
+   for (i=0; i<n; i++)
+      packed[i]=(matrix[i].format<<24) | (matrix[i].channels<<16) | matrix[i].rates;
+   g_key_file_set_integer_list(scan->cache, group, "rate_matrix", packed, n);
+   g_free(packed);
+   g_key_file_set_integer(scan->cache, group, "min_period_size", device->minPeriodSize);
+   g_key_file_set_integer(scan->cache, group, "max_period_size", device->maxPeriodSize);
+   g_key_file_set_integer(scan->cache, group, "min_buffer_size", device->minBufferSize);
+   g_key_file_set_integer(scan->cache, group, "max_buffer_size", device->maxBufferSize);
+   g_key_file_set_integer(scan->cache, group, "min_periods", device->minPeriods);
+   g_key_file_set_integer(scan->cache, group, "max_periods", device->maxPeriods);
+   g_key_file_set_integer(scan->cache, group, "access", device->access);
+   g_key_file_set_boolean(scan->cache, group, "batch", device->batch);
+   if (device->usbSync!=NULL)
+      g_key_file_set_string(scan->cache, group, "usb_sync", device->usbSync);
+   else
+      g_key_file_remove_key(scan->cache, group, "usb_sync", NULL);
+   if (device->chmaps!=NULL)
+      g_key_file_set_string(scan->cache, group, "chmaps", device->chmaps);
+   else
+      g_key_file_remove_key(scan->cache, group, "chmaps", NULL);
+   g_hash_table_add(scan->cacheChanged, group);
+   g_mutex_unlock(&scan->cacheLock);
+}
+
+/* Read a file from a substream's /proc/asound/cardN/pcmDs/subS directory. Returns NULL on error */
+static gchar *read_proc_substream(guint card, guint dev, snd_pcm_stream_t stream, guint sub, const gchar *name) {
+   gchar *filename, *contents=NULL;
+
+   filename=g_strdup_printf("/proc/asound/card%u/pcm%u%c/sub%u/%s", card, dev, stream==SND_PCM_STREAM_PLAYBACK ? 'p' : 'c', sub, name);
+   if ( ! g_file_get_contents(filename, &contents, NULL, NULL))
+      contents=NULL;
+   g_free(filename);
+   return contents;
+}
+
+/* Find a free subdevice without opening the pcm: the kernel reports "closed" for an idle substream
+ * Returns the subdevice, -1 if all are open or -2 if /proc can't be read
+ */
+static gint find_free_subdevice(guint card, guint dev, snd_pcm_stream_t stream, guint subdevices) {
+   gchar *status;
+   gint sub, free=-2;
+
+   for (sub=0; sub<MAX(subdevices, 1); sub++) {
+      status=read_proc_substream(card, dev, stream, sub, "status");
+      if (status!=NULL) {
+         if (g_str_has_prefix(status, "closed")) {
+            g_free(status);
+            return sub;
          }
+         free=-1;
+      }
+      g_free(status);
+   }
+   return free;
+}
 
-         gtk_list_store_insert_with_values (store, &iter, -1,
-                              COLUMN_CARD, cardInfo.card,
-                              COLUMN_CARD_ID, cardInfo.ID,
-                              COLUMN_CARD_NAME, cardInfo.name,
-                              COLUMN_DEVICE, dev,
-                              COLUMN_DEVICE_ID, snd_pcm_info_get_id(pcminfo),
-                              COLUMN_DEVICE_NAME, snd_pcm_info_get_name(pcminfo),
-                              COLUMN_DEVICE_ALSA_HW, hwdev,
-                              -1);
-                              
-         err=snd_pcm_open(&pcm, hwdev, stream, SND_PCM_NONBLOCK);
-         if (err!=0) {
-            if (err==-EBUSY)
-               gtk_list_store_set(store, &iter, COLUMN_IN_USE, "*", -1);
-            else {
-               g_warning("%s: Error opening pcm device %s: %s", streamType, hwdev, strerror(-err));
-               gtk_list_store_set(store, &iter, COLUMN_IN_USE, "E", -1);
-            }
+static gboolean pcm_is_busy(const ASCONFIG_DEVICE *device) {
+   return (find_free_subdevice(device->card, device->dev, device->stream, device->subdevices)==-1);
+}
+
+/* Parse the hw_params of a running substream. Returns FALSE if it is closed */
+static gboolean read_running_params(guint card, guint dev, snd_pcm_stream_t stream, guint sub, ASCONFIG_RUNNING *running) {
+   gchar *hwParams, *status, **lines, *value;
+   guint i;
+
+   memset(running, 0, sizeof(ASCONFIG_RUNNING));
+   hwParams=read_proc_substream(card, dev, stream, sub, "hw_params");
+   if (hwParams==NULL || g_str_has_prefix(hwParams, "closed")) {
+      g_free(hwParams);
+      return FALSE;
+   }
+
+   /* Lines are "name: value", e.g. "rate: 48000 (48000/1)" */
+   lines=g_strsplit(hwParams, "\n", -1);
+   for (i=0; lines[i]!=NULL; i++) {
+      value=strchr(lines[i], ':');
+      if (value==NULL)
+         continue;
+      *value++='\0';
+      g_strstrip(value);
+      if (strcmp(lines[i], "format")==0)
+         snprintf(running->format, sizeof(running->format), "%s", value);
+      else if (strcmp(lines[i], "channels")==0)
+         running->channels=strtoul(value, NULL, 10);
+      else if (strcmp(lines[i], "rate")==0)
+         running->rate=strtoul(value, NULL, 10);
+      else if (strcmp(lines[i], "period_size")==0)
+         running->periodSize=strtoul(value, NULL, 10);
+      else if (strcmp(lines[i], "buffer_size")==0)
+         running->bufferSize=strtoul(value, NULL, 10);
+   }
+   g_strfreev(lines);
+   g_free(hwParams);
+
+   /* status has "owner_pid   : 1234" */
+   status=read_proc_substream(card, dev, stream, sub, "status");
+   if (status!=NULL) {
+      value=strstr(status, "owner_pid");
+      if (value!=NULL && (value=strchr(value, ':'))!=NULL)
+         running->ownerPID=strtol(value+1, NULL, 10);
+      g_free(status);
+   }
+   return (running->rate>0);
+}
+
+/* Enumeration only: fill in what /proc/asound knows without opening the device
+ * A running device is marked busy, anything else is not probed.
+ */
+static void probe_proc(ASCONFIG_DEVICE *device) {
+   device->probed=TRUE;
+   device->inUse=pcm_is_busy(device) ? "*" : ASCONFIG_STATE_NOT_PROBED;
+}
+
+/* A busy device: take its running parameters and owner from /proc so that a
+ * config can be generated to match what the hardware is already running.
+ * The running parameters replace the defaults and device->running is set.
+ * Sets device->owner: the caller frees it with device_clear().
+ */
+static void probe_running(ASCONFIG_DEVICE *device) {
+   ASCONFIG_RUNNING running;
+   gchar *filename, *comm=NULL;
+   guint sub;
+
+   /* Report the first running subdevice */
+   for (sub=0; sub<MAX(device->subdevices, 1); sub++)
+      if (read_running_params(device->card, device->dev, device->stream, sub, &running))
+         break;
+   if (sub==MAX(device->subdevices, 1))
+      return;
+
+   device->defaultRate=running.rate;
+   device->defaultFormat=snd_pcm_format_value(running.format);
+   device->defaultChannels=running.channels;
+   device->runningPeriodSize=running.periodSize;
+   device->runningBufferSize=running.bufferSize;
+   device->running=TRUE;
+
+   if (running.ownerPID>0) {
+      filename=g_strdup_printf("/proc/%d/comm", running.ownerPID);
+      if (g_file_get_contents(filename, &comm, NULL, NULL))
+         device->owner=g_strdup_printf("%d (%s)", running.ownerPID, g_strstrip(comm));
+      else
+         device->owner=g_strdup_printf("%d", running.ownerPID);
+      g_free(comm);
+      g_free(filename);
+   }
+}
+
+/* Test every standard rate against each supported format and channel count.
+ * Each combination is tested on a copy of the full parameter space, so one
+ * test never constrains the next.
+ */
+static GBytes *probe_rate_matrix(ASCONFIG_PROBE *probe, const ASCONFIG_DEVICE *device, guint min_ch, guint max_ch) {
+   GArray *matrix=g_array_new(FALSE, FALSE, sizeof(ASCONFIG_RATE_ENTRY));
+   snd_pcm_hw_params_t *formatPars, *channelPars;
+   ASCONFIG_RATE_ENTRY entry;
+   guint fmt, channels, i;
+   gsize size;
+   gint64 start;
+   gint err;
+
+   snd_pcm_hw_params_alloca(&formatPars);
+   snd_pcm_hw_params_alloca(&channelPars);
+
+   for (fmt=0; fmt <= SND_PCM_FORMAT_LAST; fmt++) {
+      if ( ! snd_pcm_format_mask_test(probe->fmask, (snd_pcm_format_t)fmt))
+         continue;
+      snd_pcm_hw_params_copy(formatPars, probe->pars);
+      start=trace_begin();
+      err=snd_pcm_hw_params_set_format(probe->pcm, formatPars, (snd_pcm_format_t)fmt);
+      trace_end(start, "snd_pcm_hw_params_set_format", device->hwdev, device->stream);
+      if (err!=0)
+         continue;
+      for (channels=min_ch; channels<=MIN(max_ch, ASCONFIG_MATRIX_MAX_CHANNELS); channels++) {
+         snd_pcm_hw_params_copy(channelPars, formatPars);
+         start=trace_begin();
+         err=snd_pcm_hw_params_set_channels(probe->pcm, channelPars, channels);
+         trace_end(start, "snd_pcm_hw_params_set_channels", device->hwdev, device->stream);
+         if (err!=0)
             continue;
-         }
-         
-         err= snd_pcm_hw_params_any(pcm, pars);
-         if (err==0) {
-            snd_pcm_hw_params_get_channels_min(pars, &min_ch);
-            snd_pcm_hw_params_get_channels_max(pars, &max_ch);
-            snd_pcm_hw_params_get_rate_min(pars, &min_sr, NULL);
-            snd_pcm_hw_params_get_rate_max(pars, &max_sr, NULL);
-
-            snd_pcm_hw_params_get_format_mask(pars, fmask);
-            sample_formats=getSampleFormats(fmask);
-            sampleFormatsCSV=g_strjoinv(", ", sample_formats);
-
-            defaultRate=ASCONFIG_DEFAULT_RATE;
-            err=snd_pcm_hw_params_set_rate_near(pcm, pars, &defaultRate, &direction);
-            if (err!=0)
-               defaultRate=min_sr;
-         
-            err=snd_pcm_hw_params_set_format(pcm, pars, ASCONFIG_DEFAULT_FORMAT);
-            if (err==0)
-               snprintf(defaultFormat, 64, "%s", ASCONFIG_DEFAULT_FORMAT_NAME);
-            else
-               snprintf(defaultFormat, 64, "%s", sample_formats[0]); /* Fall back to first supported format */
-            
-            err=snd_pcm_hw_params_set_channels(pcm, pars, ASCONFIG_DEFAULT_CHANNELS);
-            if (err==0)
-               defaultChannels=ASCONFIG_DEFAULT_CHANNELS;
-            else
-               defaultChannels=min_ch; /* Fall back to minimum channels */
-
-            gtk_list_store_set(store, &iter,
-                                 COLUMN_IN_USE, NULL,
-                                 COLUMN_DEVICE_MIN_CHANNELS, min_ch,
-                                 COLUMN_DEVICE_MAX_CHANNELS, max_ch,
-                                 COLUMN_DEVICE_MIN_RATE, min_sr,
-                                 COLUMN_DEVICE_MAX_RATE, max_sr,
-                                 COLUMN_DEVICE_FORMAT, sampleFormatsCSV,
-                                 COLUMN_DEFAULT_RATE, defaultRate,
-                                 COLUMN_DEFAULT_FORMAT, defaultFormat,
-                                 COLUMN_DEFAULT_CHANNELS, defaultChannels,
-                                 -1);
-            free_sample_formats(sample_formats);
-            g_free(sampleFormatsCSV);
-         }
-         else {
-            g_warning("%s: Error obtaining device %s parameters", streamType, hwdev);
-            gtk_list_store_set(store, &iter, COLUMN_IN_USE, "E", -1);
-         }
-         snd_pcm_close(pcm);
-         pcm=NULL;
+         entry.format=fmt;
+         entry.channels=channels;
+         entry.rates=0;
+         start=trace_begin(); /* One span for the standard rates */
+         for (i=0; i<G_N_ELEMENTS(standardRates); i++)
+            if (snd_pcm_hw_params_test_rate(probe->pcm, channelPars, standardRates[i], 0)==0)
+               entry.rates|=1<<i;
+         trace_end(start, "snd_pcm_hw_params_test_rate", device->hwdev, device->stream);
+         if (entry.rates!=0)
+            g_array_append_val(matrix, entry);
       }
-      snd_ctl_close(handle);
-      g_free(cardInfo.ID);
-      g_free(cardInfo.name);
-  }
+   }
+   size=matrix->len*sizeof(ASCONFIG_RATE_ENTRY);
+   return g_bytes_new_take(g_array_free(matrix, FALSE), size);
+}
+
+/* Choose the default rate, format and channels from natively supported combinations
+ * Channels closest to ASCONFIG_DEFAULT_CHANNELS come first, then the rate closest to
+ * ASCONFIG_DEFAULT_RATE, then ASCONFIG_DEFAULT_FORMAT or the first supported format.
+ * Returns FALSE if the matrix is empty.
+ */
+static gboolean choose_defaults(GBytes *rateMatrix, guint *rate, snd_pcm_format_t *format, guint *channels) {
+   const ASCONFIG_RATE_ENTRY *matrix;
+   gsize size;
+   guint n, i, r;
+   gint64 score, bestScore=G_MAXINT64;
+
+   matrix=g_bytes_get_data(rateMatrix, &size);
+   n=size/sizeof(ASCONFIG_RATE_ENTRY);
+   for (i=0; i<n; i++) {
+      for (r=0; r<G_N_ELEMENTS(standardRates); r++) {
+         if ( ! (matrix[i].rates & (1<<r)))
+            continue;
+         score=(gint64)ABS((gint)matrix[i].channels-ASCONFIG_DEFAULT_CHANNELS)<<32;
+         score|=(gint64)ABS((gint)standardRates[r]-ASCONFIG_DEFAULT_RATE)<<8;
+         score|=(matrix[i].format==ASCONFIG_DEFAULT_FORMAT) ? 0 : 1+MIN(matrix[i].format, 0xfe);
+         if (score<bestScore) {
+            bestScore=score;
+            *rate=standardRates[r];
+            *format=matrix[i].format;
+            *channels=matrix[i].channels;
+         }
+      }
+   }
+   return (bestScore!=G_MAXINT64);
+}
+
+/* Comma separated list of the standard rates (kHz) in rates */
+static gchar *rate_list(guint16 rates) {
+   GString *list=g_string_new(NULL);
+   guint r;
+
+   for (r=0; r<G_N_ELEMENTS(standardRates); r++)
+      if (rates & (1<<r))
+         g_string_append_printf(list, "%s%g", list->len ? ", " : "", standardRates[r]/1000.0);
+   return g_string_free(list, FALSE);
+}
+
+/* Mask of the standard rates supported natively at format and channels */
+static guint16 native_rates(GBytes *rateMatrix, snd_pcm_format_t format, guint channels) {
+   const ASCONFIG_RATE_ENTRY *matrix;
+   gsize size;
+   guint n, i;
+   guint16 rates=0;
+
+   matrix=g_bytes_get_data(rateMatrix, &size);
+   n=size/sizeof(ASCONFIG_RATE_ENTRY);
+   for (i=0; i<n; i++)
+      if (matrix[i].format==format && matrix[i].channels==channels)
+         rates|=matrix[i].rates;
+   return rates;
+}
+
+static void rate_matrix_add(GArray *matrix, snd_pcm_format_t format, guint channels, guint16 rates) {
+   ASCONFIG_RATE_ENTRY *entry, newEntry;
+   guint i;
+
+   for (i=0; i<matrix->len; i++) {
+      entry=&g_array_index(matrix, ASCONFIG_RATE_ENTRY, i);
+      if (entry->format==format && entry->channels==channels) {
+         entry->rates|=rates;
+         return;
+      }
+   }
+   newEntry.format=format;
+   newEntry.channels=channels;
+   newEntry.rates=rates;
+   g_array_append_val(matrix, newEntry);
+}
+
+/* Standard rates in a /proc stream "Rates:" value: "44100, 48000" or "8000 - 48000 (continuous)" */
+static guint16 parse_stream_rates(const gchar *value) {
+   gchar **rates;
+   guint i, r, min, max;
+   guint16 mask=0;
+
+   if (strstr(value, "continuous")!=NULL) {
+      if (sscanf(value, "%u - %u", &min, &max)==2)
+         for (r=0; r<G_N_ELEMENTS(standardRates); r++)
+            if (standardRates[r]>=min && standardRates[r]<=max)
+               mask|=1<<r;
+      return mask;
+   }
+   rates=g_strsplit(value, ",", -1);
+   for (i=0; rates[i]!=NULL; i++)
+      for (r=0; r<G_N_ELEMENTS(standardRates); r++)
+         if (strtoul(rates[i], NULL, 10)==standardRates[r])
+            mask|=1<<r;
+   g_strfreev(rates);
+   return mask;
+}
+
+/* USB audio: the hw_params rate is a range, but each altsetting of the interface
+ * supports a discrete set of rates for its format and channel count. Read the
+ * altsettings from /proc/asound/cardN/streamD, e.g.
+ *   Playback:
+ *     ...
+ *     Altset 1
+ *     Format: S32_LE
+ *     Channels: 2
+ *     Endpoint: 0x01 (1 OUT) (ASYNC)
+ *     Rates: 44100, 48000, 88200, 96000
+ * and replace the rate matrix, defaults and native rates of a probed device with
+ * the exact combinations. Sets device->usbSync to the endpoint sync types.
+ */
+static void probe_usb_streams(const ASCONFIG_CARD *cardInfo, ASCONFIG_DEVICE *device) {
+   gchar *filename, *contents, **lines, *line, *value, *sync, **formats=NULL;
+   GArray *matrix;
+   GString *syncTypes;
+   gboolean inStream=FALSE;
+   guint i, j, channels=0, rate, defaultChannels;
+   snd_pcm_format_t format, defaultFormat;
+   guint16 rates;
+   gsize size;
+
+   if (g_strcmp0(cardInfo->driver, "USB-Audio")!=0 || device->formats==0)
+      return;
+   filename=g_strdup_printf("/proc/asound/card%u/stream%u", device->card, device->dev);
+   if ( ! g_file_get_contents(filename, &contents, NULL, NULL)) {
+      g_free(filename);
+      return;
+   }
+
+   matrix=g_array_new(FALSE, FALSE, sizeof(ASCONFIG_RATE_ENTRY));
+   syncTypes=g_string_new(NULL);
+   lines=g_strsplit(contents, "\n", -1);
+   for (i=0; lines[i]!=NULL; i++) {
+      line=g_strstrip(lines[i]);
+      if (strcmp(line, "Playback:")==0 || strcmp(line, "Capture:")==0) {
+         inStream=g_str_has_prefix(line, streamNames[device->stream]);
+         continue;
+      }
+      if ( ! inStream || (value=strchr(line, ':'))==NULL)
+         continue;
+      *value++='\0';
+      g_strstrip(value);
+
+      if (strcmp(line, "Format")==0) {
+         g_strfreev(formats);
+         formats=g_strsplit(value, " ", -1);
+      }
+      else if (strcmp(line, "Channels")==0)
+         channels=strtoul(value, NULL, 10);
+      else if (strcmp(line, "Endpoint")==0) {
+         /* Sync type is the last parenthesised field */
+         if ((sync=strrchr(value, '('))!=NULL && strchr(sync, ')')!=NULL) {
+            sync++;
+            *strchr(sync, ')')='\0';
+            if (strstr(syncTypes->str, sync)==NULL)
+               g_string_append_printf(syncTypes, "%s%s", syncTypes->len ? ", " : "", sync);
+         }
+      }
+      else if (strcmp(line, "Rates")==0 && formats!=NULL && channels>0) { /* Last field of an altsetting */
+         rates=parse_stream_rates(value);
+         for (j=0; formats[j]!=NULL && rates!=0; j++) {
+            format=snd_pcm_format_value(formats[j]);
+            if (format!=SND_PCM_FORMAT_UNKNOWN)
+               rate_matrix_add(matrix, format, channels, rates);
+         }
+      }
+   }
+   g_strfreev(formats);
+   g_strfreev(lines);
+   g_free(contents);
+   g_free(filename);
+
+   if (syncTypes->len>0) {
+      g_free(device->usbSync);
+      device->usbSync=g_string_free(syncTypes, FALSE);
+   }
+   else
+      g_string_free(syncTypes, TRUE);
+
+   if (matrix->len==0) {
+      g_array_free(matrix, TRUE);
+      return;
+   }
+   size=matrix->len*sizeof(ASCONFIG_RATE_ENTRY);
+   g_bytes_unref(device->rateMatrix);
+   device->rateMatrix=g_bytes_new_take(g_array_free(matrix, FALSE), size);
+   if (choose_defaults(device->rateMatrix, &rate, &defaultFormat, &defaultChannels)) {
+      device->defaultRate=rate;
+      device->defaultFormat=defaultFormat;
+      device->defaultChannels=defaultChannels;
+      device->nativeRates=native_rates(device->rateMatrix, defaultFormat, defaultChannels);
+   }
+}
+
+/* The combinations with at most maxChannels and one of rates */
+static GBytes *rate_matrix_intersect(GBytes *rateMatrix, guint maxChannels, guint16 rates) {
+   const ASCONFIG_RATE_ENTRY *matrix;
+   GArray *result=g_array_new(FALSE, FALSE, sizeof(ASCONFIG_RATE_ENTRY));
+   gsize size;
+   guint n, i;
+
+   matrix=g_bytes_get_data(rateMatrix, &size);
+   n=size/sizeof(ASCONFIG_RATE_ENTRY);
+   for (i=0; i<n; i++)
+      if (matrix[i].channels<=maxChannels && (matrix[i].rates & rates))
+         rate_matrix_add(result, matrix[i].format, matrix[i].channels, matrix[i].rates & rates);
+   size=result->len*sizeof(ASCONFIG_RATE_ENTRY);
+   return g_bytes_new_take(g_array_free(result, FALSE), size);
+}
+
+/* HDMI/DP: read the connected sink's ELD from the pcm device's "ELD" control
+ * and choose the defaults from what both the device and the sink accept, so
+ * the sink doesn't resample again. The ELD baseline block starts at byte 4:
+ * byte 4 bits 0-4 are the monitor name length, byte 5 bits 4-7 the number of
+ * short audio descriptors; the name starts at byte 20 followed by the 3 byte
+ * SADs. Only LPCM SADs (format code 1) are used. Sets device->sink.
+ */
+static void probe_eld(ASCONFIG_PROBE *probe, ASCONFIG_DEVICE *device) {
+   static const guint eldRates[]={ 32000, 44100, 48000, 88200, 96000, 176400, 192000 }; /* SAD byte 1 bits 0-6 */
+   snd_ctl_elem_id_t *id;
+   snd_ctl_elem_info_t *info;
+   snd_ctl_elem_value_t *value;
+   const guint8 *eld, *sad;
+   guint count, nameLength, sads, i, r, s, channels=0;
+   guint16 rates=0;
+   gchar *name, *rateNames;
+   GBytes *sinkMatrix;
+   guint defaultRate, defaultChannels;
+   snd_pcm_format_t defaultFormat;
+
+   if (device->stream!=SND_PCM_STREAM_PLAYBACK)
+      return;
+   snd_ctl_elem_id_alloca(&id);
+   snd_ctl_elem_info_alloca(&info);
+   snd_ctl_elem_value_alloca(&value);
+   snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_PCM);
+   snd_ctl_elem_id_set_name(id, "ELD");
+   snd_ctl_elem_id_set_device(id, device->dev);
+   snd_ctl_elem_info_set_id(info, id);
+   if (snd_ctl_elem_info(probe->handle, info)!=0)
+      return; /* Not HDMI/DP */
+   count=snd_ctl_elem_info_get_count(info);
+   snd_ctl_elem_value_set_id(value, id);
+   if (count<20 || snd_ctl_elem_read(probe->handle, value)!=0)
+      return; /* No sink connected: the ELD is empty */
+   eld=snd_ctl_elem_value_get_bytes(value);
+   nameLength=eld[4] & 0x1f;
+   sads=eld[5]>>4;
+   if (20+nameLength+3*sads>count)
+      return;
+
+   for (i=0; i<sads; i++) {
+      sad=eld+20+nameLength+3*i;
+      if (((sad[0]>>3) & 0x0f)!=1)
+         continue;
+      channels=MAX(channels, (sad[0] & 0x07)+1);
+      for (r=0; r<G_N_ELEMENTS(eldRates); r++)
+         if (sad[1] & (1<<r))
+            for (s=0; s<G_N_ELEMENTS(standardRates); s++)
+               if (standardRates[s]==eldRates[r])
+                  rates|=1<<s;
+   }
+
+   name=g_strndup((const gchar *)eld+20, nameLength);
+   for (i=0; name[i]!='\0'; i++)
+      if ( ! isprint((guchar)name[i]))
+         name[i]='?';
+   rateNames=rate_list(rates);
+   device->sink=g_strdup_printf("%s: %u ch, %s kHz", name[0] ? name : "unnamed", channels, rateNames);
+   g_free(rateNames);
+   g_free(name);
+
+   if (channels==0 || device->rateMatrix==NULL)
+      return;
+   sinkMatrix=rate_matrix_intersect(device->rateMatrix, channels, rates);
+   if (choose_defaults(sinkMatrix, &defaultRate, &defaultFormat, &defaultChannels)) {
+      device->defaultRate=defaultRate;
+      device->defaultFormat=defaultFormat;
+      device->defaultChannels=defaultChannels;
+      device->nativeRates=native_rates(sinkMatrix, defaultFormat, defaultChannels);
+   }
+   g_bytes_unref(sinkMatrix);
+}
+
+/* The channel maps the device offers, one per channel count */
+static gchar *probe_chmaps(ASCONFIG_PROBE *probe) {
+   snd_pcm_chmap_query_t **maps;
+   GString *chmaps;
+   guint i, j;
+
+   maps=snd_pcm_query_chmaps(probe->pcm);
+   if (maps==NULL)
+      return NULL;
+   chmaps=g_string_new(NULL);
+   for (i=0; maps[i]!=NULL; i++) {
+      g_string_append(chmaps, chmaps->len ? ";" : "");
+      for (j=0; j<maps[i]->map.channels; j++)
+         g_string_append_printf(chmaps, "%s%s", j ? " " : "", snd_pcm_chmap_name(maps[i]->map.pos[j]));
+   }
+   snd_pcm_free_chmaps(maps);
+   return g_string_free(chmaps, chmaps->len==0);
+}
+
+/* Period, buffer and access limits of the full parameter space */
+static void probe_buffer_limits(ASCONFIG_PROBE *probe, ASCONFIG_DEVICE *device) {
+   snd_pcm_uframes_t frames;
+   guint i;
+
+   snd_pcm_hw_params_get_period_size_min(probe->pars, &frames, NULL);
+   device->minPeriodSize=MIN(frames, G_MAXUINT);
+   snd_pcm_hw_params_get_period_size_max(probe->pars, &frames, NULL);
+   device->maxPeriodSize=MIN(frames, G_MAXUINT);
+   snd_pcm_hw_params_get_buffer_size_min(probe->pars, &frames);
+   device->minBufferSize=MIN(frames, G_MAXUINT);
+   snd_pcm_hw_params_get_buffer_size_max(probe->pars, &frames);
+   device->maxBufferSize=MIN(frames, G_MAXUINT);
+   snd_pcm_hw_params_get_periods_min(probe->pars, &device->minPeriods, NULL);
+   snd_pcm_hw_params_get_periods_max(probe->pars, &device->maxPeriods, NULL);
+   device->batch=snd_pcm_hw_params_is_batch(probe->pars);
+
+   device->access=0;
+   for (i=0; i<=SND_PCM_ACCESS_LAST; i++)
+      if (snd_pcm_hw_params_test_access(probe->pcm, probe->pars, (snd_pcm_access_t)i)==0)
+         device->access|=1<<i;
+}
+
+/* Open the device and read its hardware parameters into device
+ * Sets the device probe results: the caller frees them with device_clear()
+ */
+static void probe_pcm(ASCONFIG_PROBE *probe, ASCONFIG_DEVICE *device)
+{
+   guint min_sr, max_sr, min_ch, max_ch;
+   guint defaultRate, defaultChannels;
+   snd_pcm_format_t defaultFormat;
+   gint err, direction;
+   guint64 formats=0;
+   snd_pcm_format_t format, firstFormat=SND_PCM_FORMAT_UNKNOWN;
+   snd_pcm_hw_params_t *testPars;
+   const gchar *streamType=streamNames[device->stream];
+   gint64 start;
+
+   device->probed=TRUE;
+   start=trace_begin();
+   err=snd_pcm_open(&probe->pcm, device->hwdev, device->stream, SND_PCM_NONBLOCK);
+   trace_end(start, "snd_pcm_open", device->hwdev, device->stream);
+   if (err!=0) {
+      if (err==-EBUSY)
+         device->inUse="*";
+      else {
+         g_warning("%s: Error opening pcm device %s: %s", streamType, device->hwdev, strerror(-err));
+         device->inUse="E";
+      }
+      return;
+   }
+   
+   start=trace_begin();
+   err= snd_pcm_hw_params_any(probe->pcm, probe->pars);
+   trace_end(start, "snd_pcm_hw_params_any", device->hwdev, device->stream);
+   if (err==0) {
+      snd_pcm_hw_params_get_channels_min(probe->pars, &min_ch);
+      snd_pcm_hw_params_get_channels_max(probe->pars, &max_ch);
+      snd_pcm_hw_params_get_rate_min(probe->pars, &min_sr, NULL);
+      snd_pcm_hw_params_get_rate_max(probe->pars, &max_sr, NULL);
+
+      snd_pcm_hw_params_get_format_mask(probe->pars, probe->fmask);
+      for (format=0; format<=SND_PCM_FORMAT_LAST; format++)
+         if (snd_pcm_format_mask_test(probe->fmask, format)) {
+            formats|=(guint64)1<<format;
+            if (firstFormat==SND_PCM_FORMAT_UNKNOWN)
+               firstFormat=format;
+         }
+
+      device->rateMatrix=probe_rate_matrix(probe, device, min_ch, max_ch);
+      if ( ! choose_defaults(device->rateMatrix, &defaultRate, &defaultFormat, &defaultChannels)) {
+         /* No standard rate: test each default on its own copy of the parameters */
+         snd_pcm_hw_params_alloca(&testPars);
+         snd_pcm_hw_params_copy(testPars, probe->pars);
+         defaultRate=ASCONFIG_DEFAULT_RATE;
+         start=trace_begin();
+         err=snd_pcm_hw_params_set_rate_near(probe->pcm, testPars, &defaultRate, &direction);
+         trace_end(start, "snd_pcm_hw_params_set_rate_near", device->hwdev, device->stream);
+         if (err!=0)
+            defaultRate=min_sr;
+         if (snd_pcm_hw_params_test_format(probe->pcm, probe->pars, ASCONFIG_DEFAULT_FORMAT)==0)
+            defaultFormat=ASCONFIG_DEFAULT_FORMAT;
+         else
+            defaultFormat=firstFormat!=SND_PCM_FORMAT_UNKNOWN ? firstFormat : ASCONFIG_DEFAULT_FORMAT; /* Fall back to first supported format */
+         if (snd_pcm_hw_params_test_channels(probe->pcm, probe->pars, ASCONFIG_DEFAULT_CHANNELS)==0)
+            defaultChannels=ASCONFIG_DEFAULT_CHANNELS;
+         else
+            defaultChannels=min_ch; /* Fall back to minimum channels */
+      }
+
+      device->inUse=NULL;
+      device->min_ch=min_ch;
+      device->max_ch=max_ch;
+      device->min_sr=min_sr;
+      device->max_sr=max_sr;
+      device->formats=formats;
+      device->defaultRate=defaultRate;
+      device->defaultFormat=defaultFormat;
+      device->defaultChannels=defaultChannels;
+      device->nativeRates=native_rates(device->rateMatrix, defaultFormat, defaultChannels);
+      probe_buffer_limits(probe, device);
+      start=trace_begin();
+      device->chmaps=probe_chmaps(probe);
+      trace_end(start, "snd_pcm_query_chmaps", device->hwdev, device->stream);
+   }
+   else {
+      g_warning("%s: Error obtaining device %s parameters", streamType, device->hwdev);
+      device->inUse="E";
+   }
+   start=trace_begin();
+   snd_pcm_close(probe->pcm);
+   trace_end(start, "snd_pcm_close", device->hwdev, device->stream);
+   probe->pcm=NULL;
+}
+
+static void probe_job_unref(ASCONFIG_PROBE_JOB *job) {
+   if (g_atomic_int_dec_and_test(&job->ref)) {
+      device_clear(&job->device);
+      g_mutex_clear(&job->lock);
+      g_cond_clear(&job->cond);
+      g_free(job);
+   }
+}
+
+static gpointer probe_job_thread(gpointer data) {
+   ASCONFIG_PROBE_JOB *job=data;
+   ASCONFIG_PROBE probe;
+
+   snd_pcm_hw_params_alloca(&probe.pars);
+   snd_pcm_format_mask_alloca(&probe.fmask);
+   probeBackend->probe_pcm(&probe, &job->device);
+
+   g_mutex_lock(&job->lock);
+   job->done=TRUE;
+   g_cond_signal(&job->cond);
+   g_mutex_unlock(&job->lock);
+   probe_job_unref(job);
+   return NULL;
+}
+
+/* probe_pcm() with a deadline of probeTimeout ms. A device which misses it
+ * is marked "T" and left to finish (or hang) in its own thread.
+ * Sets the device probe results: the caller frees them with device_clear()
+ */
+static void probe_pcm_watchdog(ASCONFIG_DEVICE *device) {
+   ASCONFIG_PROBE_JOB *job;
+   GThread *thread;
+   gint64 deadline;
+
+   if (probeTimeout<=0) {
+      ASCONFIG_PROBE probe;
+
+      snd_pcm_hw_params_alloca(&probe.pars);
+      snd_pcm_format_mask_alloca(&probe.fmask);
+      probeBackend->probe_pcm(&probe, device);
+      return;
+   }
+
+   job=g_new0(ASCONFIG_PROBE_JOB, 1);
+   job->ref=2; /* Caller and probe thread */
+   g_mutex_init(&job->lock);
+   g_cond_init(&job->cond);
+   job->device=*device; /* The probe thread only uses the device's identity */
+
+   thread=g_thread_try_new("asconfig-probe", probe_job_thread, job, NULL);
+   if (thread==NULL) {
+      g_warning("%s: Error starting probe thread for %s", streamNames[device->stream], device->hwdev);
+      device->probed=TRUE;
+      device->inUse="E";
+      job->ref=1;
+      probe_job_unref(job);
+      return;
+   }
+   g_thread_unref(thread);
+
+   deadline=g_get_monotonic_time()+probeTimeout*G_TIME_SPAN_MILLISECOND;
+   g_mutex_lock(&job->lock);
+   while ( ! job->done)
+      if ( ! g_cond_wait_until(&job->cond, &job->lock, deadline))
+         break;
+
+   device->probed=TRUE;
+   if (job->done) { /* Take over the results */
+      *device=job->device;
+      memset(&job->device, 0, sizeof(ASCONFIG_DEVICE));
+   }
+   else {
+      g_warning("%s: Timeout probing pcm device %s after %d ms", streamNames[device->stream], device->hwdev, probeTimeout);
+      device->inUse="T";
+   }
+   g_mutex_unlock(&job->lock);
+   probe_job_unref(job);
+}
+
+/* Open the card's ctl and read the card info. Returns FALSE on error */
+static gboolean alsa_card_open(ASCONFIG_PROBE *probe, gint card, ASCONFIG_CARD *cardInfo) {
+   gchar hwdev[64];
+   gint err;
+   gint64 start;
+
+   snprintf(hwdev, 64, "hw:%d", card);
+   start=trace_begin();
+   err=snd_ctl_open(&probe->handle, hwdev, 0);
+   trace_end(start, "snd_ctl_open", hwdev, ASCONFIG_TRACE_CARD);
+   if (err!=0) {
+      g_warning("Error opening card %s: %s", hwdev, strerror(-err));
+      return FALSE;
+   }
+   start=trace_begin();
+   err=snd_ctl_card_info(probe->handle, probe->info);
+   trace_end(start, "snd_ctl_card_info", hwdev, ASCONFIG_TRACE_CARD);
+   if (err!=0) {
+      g_warning("Error opening card %s: %s", hwdev, strerror(-err));
+      snd_ctl_close(probe->handle);
+      return FALSE;
+   }
+   probe->card=card;
+   cardInfo->card=card;
+   cardInfo->ID=g_strdup(snd_ctl_card_info_get_id(probe->info));
+   cardInfo->name=g_strdup(snd_ctl_card_info_get_name(probe->info));
+   cardInfo->driver=g_strdup(snd_ctl_card_info_get_driver(probe->info));
+   cardInfo->longname=g_strdup(snd_ctl_card_info_get_longname(probe->info));
+   cardInfo->components=g_strdup(snd_ctl_card_info_get_components(probe->info));
+   return TRUE;
+}
+
+static void card_info_clear(ASCONFIG_CARD *cardInfo) {
+   g_free(cardInfo->ID);
+   g_free(cardInfo->name);
+   g_free(cardInfo->driver);
+   g_free(cardInfo->longname);
+   g_free(cardInfo->components);
+}
+
+static void alsa_card_close(ASCONFIG_PROBE *probe, ASCONFIG_CARD *cardInfo) {
+   snd_ctl_close(probe->handle);
+   card_info_clear(cardInfo);
+}
+
+static gint alsa_pcm_next_device(ASCONFIG_PROBE *probe, gint *dev) {
+   return snd_ctl_pcm_next_device(probe->handle, dev);
+}
+
+/* The device's identity strings point into probe->pcminfo: valid until the next call */
+static gint alsa_pcm_info(ASCONFIG_PROBE *probe, gint dev, snd_pcm_stream_t stream, ASCONFIG_DEVICE *device) {
+   gchar hwdev[64];
+   gint64 start;
+   gint err;
+
+   snprintf(hwdev, 64, "hw:%d,%d", probe->card, dev);
+   snd_pcm_info_set_device(probe->pcminfo, dev);
+   snd_pcm_info_set_subdevice(probe->pcminfo, 0);
+   snd_pcm_info_set_stream(probe->pcminfo, stream);
+   start=trace_begin();
+   err=snd_ctl_pcm_info(probe->handle, probe->pcminfo);
+   trace_end(start, "snd_ctl_pcm_info", hwdev, stream);
+   if (err!=0)
+      return err;
+   device->devID=(gchar *)snd_pcm_info_get_id(probe->pcminfo);
+   device->devName=(gchar *)snd_pcm_info_get_name(probe->pcminfo);
+   device->subdevices=snd_pcm_info_get_subdevices_count(probe->pcminfo);
+   device->subdevicesAvail=snd_pcm_info_get_subdevices_avail(probe->pcminfo);
+   return 0;
+}
+
+static const ASCONFIG_BACKEND alsaBackend={
+   "alsa", TRUE,
+   snd_card_next,
+   alsa_card_open,
+   alsa_card_close,
+   alsa_pcm_next_device,
+   alsa_pcm_info,
+   probe_pcm,
+   probe_eld
+};
+
+/* Mock backend
+ * mockConfig.cards cards of mockConfig.devices devices, each with a playback and a
+ * capture pcm. Opening a pcm takes mockConfig.latency ms; mockConfig.busy and
+ * mockConfig.error percent of the pcms fail to open. Which ones is fixed by the
+ * pcm's name, so every scan sees the same hardware. Nothing is cached.
+ */
+static gint mock_card_next(gint *card) {
+   *card=(*card+1<(gint)mockConfig.cards) ? *card+1 : -1;
+   return 0;
+}
+
+static gboolean mock_card_open(ASCONFIG_PROBE *probe, gint card, ASCONFIG_CARD *cardInfo) {
+   if (card<0 || card>=(gint)mockConfig.cards)
+      return FALSE;
+   probe->card=card;
+   cardInfo->card=card;
+   cardInfo->ID=g_strdup_printf("Mock%d", card);
+   cardInfo->name=g_strdup_printf("Mock card %d", card);
+   cardInfo->driver=g_strdup("Mock");
+   cardInfo->longname=g_strdup_printf("Simulated card %d", card);
+   cardInfo->components=g_strdup("");
+   return TRUE;
+}
+
+static void mock_card_close(ASCONFIG_PROBE *probe, ASCONFIG_CARD *cardInfo) {
+   card_info_clear(cardInfo);
+}
+
+static gint mock_pcm_next_device(ASCONFIG_PROBE *probe, gint *dev) {
+   *dev=(*dev+1<(gint)mockConfig.devices) ? *dev+1 : -1;
+   return 0;
+}
+
+static gint mock_pcm_info(ASCONFIG_PROBE *probe, gint dev, snd_pcm_stream_t stream, ASCONFIG_DEVICE *device) {
+   gchar name[64];
+
+   snprintf(name, 64, "MOCK%d", dev);
+   device->devID=(gchar *)g_intern_string(name);
+   snprintf(name, 64, "Mock pcm %d", dev);
+   device->devName=(gchar *)g_intern_string(name);
+   device->subdevices=1;
+   device->subdevicesAvail=1;
+   return 0;
+}
+
+/* A stereo, 5.1 and 7.1 device at the standard rates up to 192k in S16, S24 and S32 */
+static void mock_probe_pcm(ASCONFIG_PROBE *probe, ASCONFIG_DEVICE *device) {
+   static const snd_pcm_format_t formats[]={ SND_PCM_FORMAT_S16_LE, SND_PCM_FORMAT_S24_LE, SND_PCM_FORMAT_S32_LE };
+   static const guint channels[]={ 2, 6, 8 };
+   GArray *matrix=g_array_new(FALSE, FALSE, sizeof(ASCONFIG_RATE_ENTRY));
+   guint f, c, hash;
+   gsize size;
+   gint64 start;
+
+   device->probed=TRUE;
+   start=trace_begin();
+   g_usleep(MAX(mockConfig.latency, 0)*G_TIME_SPAN_MILLISECOND);
+   trace_end(start, "snd_pcm_open", device->hwdev, device->stream);
+   hash=g_str_hash(device->hwdev)+device->stream;
+   if ((gint)(hash%100)<mockConfig.busy) {
+      device->inUse="*";
+      g_array_free(matrix, TRUE);
+      return;
+   }
+   if ((gint)((hash/100)%100)<mockConfig.error) {
+      device->inUse="E";
+      g_array_free(matrix, TRUE);
+      return;
+   }
+
+   for (f=0; f<G_N_ELEMENTS(formats); f++)
+      for (c=0; c<G_N_ELEMENTS(channels); c++)
+         rate_matrix_add(matrix, formats[f], channels[c], (1<<11)-1); /* 8k to 192k */
+   size=matrix->len*sizeof(ASCONFIG_RATE_ENTRY);
+   device->rateMatrix=g_bytes_new_take(g_array_free(matrix, FALSE), size);
+
+   device->inUse=NULL;
+   device->min_ch=2;
+   device->max_ch=8;
+   device->min_sr=8000;
+   device->max_sr=192000;
+   for (f=0; f<G_N_ELEMENTS(formats); f++)
+      device->formats|=(guint64)1<<formats[f];
+   device->defaultRate=ASCONFIG_DEFAULT_RATE;
+   device->defaultFormat=ASCONFIG_DEFAULT_FORMAT;
+   device->defaultChannels=ASCONFIG_DEFAULT_CHANNELS;
+   device->nativeRates=native_rates(device->rateMatrix, ASCONFIG_DEFAULT_FORMAT, ASCONFIG_DEFAULT_CHANNELS);
+   device->minPeriodSize=32;
+   device->maxPeriodSize=16384;
+   device->minBufferSize=64;
+   device->maxBufferSize=65536;
+   device->minPeriods=2;
+   device->maxPeriods=32;
+   device->access=(1<<SND_PCM_ACCESS_MMAP_INTERLEAVED) | (1<<SND_PCM_ACCESS_RW_INTERLEAVED);
+   device->chmaps=g_strdup("FL FR;FL FR RL RR FC LFE;FL FR RL RR FC LFE SL SR");
+}
+
+static const ASCONFIG_BACKEND mockBackend={
+   "mock", FALSE,
+   mock_card_next,
+   mock_card_open,
+   mock_card_close,
+   mock_pcm_next_device,
+   mock_pcm_info,
+   mock_probe_pcm,
+   NULL
+};
+
+/* Called from a scan pool thread: the card's ctl is opened once and both
+ * directions of each device are probed. Rows are streamed to the main loop
+ * as each device is probed.
+ */
+static void scancard(ASCONFIG_SCAN *scan, ASCONFIG_PROBE *probe, gint card)
+{
+   gchar hwdev[64];
+   gint err, dev;
+   snd_pcm_stream_t stream;
+   ASCONFIG_CARD cardInfo;
+   ASCONFIG_DEVICE device;
+   gint64 probeStart;
+
+   if (g_cancellable_is_cancelled(scan->cancellable))
+      return;
+
+   if ( ! probeBackend->card_open(probe, card, &cardInfo))
+      return;
+   
+   dev=-1;  /* Return first available device */
+
+   while (probeBackend->pcm_next_device(probe, &dev)==0 && dev>=0) {
+      snprintf(hwdev, 64, "hw:%d,%d", card, dev);
+      for (stream=SND_PCM_STREAM_PLAYBACK; stream<=SND_PCM_STREAM_CAPTURE; stream++) {
+         if (g_cancellable_is_cancelled(scan->cancellable))
+            break;
+         device_init(&device);
+         probeStart=trace_begin();
+         err=probeBackend->pcm_info(probe, dev, stream, &device);
+         if (err!=0) {
+            if (err!=-ENOENT) /* ENOENT: device has no pcm in this direction */
+               g_warning("%s: Error opening device %s: %s", streamNames[stream], hwdev, strerror(-err));
+            continue;
+         }
+
+         device.scan=scan;
+         device.stream=stream;
+         device.card=cardInfo.card;
+         device.dev=dev;
+         device.cardInfo=card_intern(&cardInfo);
+         snprintf(device.hwdev, 64, "%s", hwdev);
+         post_device(&device); /* Show the row as probing */
+
+         if (scan->useCache && scan->cache!=NULL && cache_lookup(scan, &cardInfo, &device)) {
+            /* Cache hit: only the busy state can have changed */
+            device.probed=TRUE;
+            device.inUse=pcm_is_busy(&device) ? "*" : NULL;
+         }
+         else if ( ! scan->deep)
+            probe_proc(&device);
+         else {
+            probe_pcm_watchdog(&device);
+            probe_usb_streams(&cardInfo, &device);
+            if (device.formats!=0 && scan->cache!=NULL)
+               cache_store(scan, &cardInfo, &device);
+         }
+         if (probeBackend->probe_eld!=NULL)
+            probeBackend->probe_eld(probe, &device); /* Not cached: the sink can change at any time */
+         if (g_strcmp0(device.inUse, "*")==0)
+            probe_running(&device);
+         else
+            device.freeSubdevice=MAX(find_free_subdevice(card, dev, stream, device.subdevices), -1);
+         trace_end(probeStart, "probe", hwdev, stream);
+         post_device(&device);
+         device_clear(&device);
+      }
+   }
+   probeBackend->card_close(probe, &cardInfo);
+}
+
+/* Pool task: probe one card with its own alsa state */
+static void scan_card_task(gpointer data, gpointer user_data) {
+   ASCONFIG_SCAN *scan=user_data;
+   gint card=GPOINTER_TO_INT(data)-1;
+   ASCONFIG_PROBE probe;
+
+   snd_ctl_card_info_alloca(&probe.info);
+   snd_pcm_info_alloca(&probe.pcminfo);
+
+   scancard(scan, &probe, card);
+}
+
+/* Probe every card in parallel, one pool task per card, so one slow card doesn't hold up the rest
+ * Returns when all cards are done.
+ */
+static void scan_cards(ASCONFIG_SCAN *scan) {
+   GThreadPool *pool;
+   gint card=-1; /* Return first available card */
+
+   if (probeBackend->cache)
+      scan->cache=cache_load();
+   pool=g_thread_pool_new(scan_card_task, scan, -1, FALSE, NULL);
+   if (scan->card>=0)
+      g_thread_pool_push(pool, GINT_TO_POINTER(scan->card+1), NULL);
+   else
+      while (probeBackend->card_next(&card)==0 && card>=0 && ! g_cancellable_is_cancelled(scan->cancellable))
+         g_thread_pool_push(pool, GINT_TO_POINTER(card+1), NULL); /* +1: NULL is not a valid task */
+   g_thread_pool_free(pool, FALSE, TRUE); /* Wait for all cards */
+
+   if (g_hash_table_size(scan->cacheChanged)>0 && ! g_cancellable_is_cancelled(scan->cancellable))
+      cache_save(scan);
+}
+
+static void scan_thread(GTask *task, gpointer source_object, gpointer task_data, GCancellable *cancellable) {
+   scan_cards(task_data);
+   g_task_return_boolean(task, TRUE);
+}
+
+static void scan_done(GObject *source_object, GAsyncResult *result, gpointer user_data) {
+   ASCONFIG_SCAN *scan=g_task_get_task_data(G_TASK(result));
+
+   if (scan==currentScan) {
+      scan_unref(currentScan);
+      currentScan=NULL;
+      if (probeTrace!=NULL)
+         trace_save(probeTrace);
+   }
+}
+
+/* deviceTreeview: NULL for a headless scan which shows nothing */
+static ASCONFIG_SCAN *scan_new(ASCONFIG_DEVICE_VIEW *deviceTreeview, gboolean useCache, gboolean deep) {
+   ASCONFIG_SCAN *scan=g_new0(ASCONFIG_SCAN, 1);
+
+   scan->ref=1;
+   scan->cancellable=g_cancellable_new();
+   if (deviceTreeview!=NULL) {
+      scan->store[SND_PCM_STREAM_PLAYBACK]=g_object_ref(gtk_tree_view_get_model(GTK_TREE_VIEW(deviceTreeview->playbackTreeview)));
+      scan->store[SND_PCM_STREAM_CAPTURE]=g_object_ref(gtk_tree_view_get_model(GTK_TREE_VIEW(deviceTreeview->captureTreeview)));
+   }
+   scan->useCache=useCache;
+   scan->deep=deep;
+   scan->card=-1;
+   scan->view=deviceTreeview;
+   g_mutex_init(&scan->cacheLock);
+   scan->cacheChanged=g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+   g_mutex_init(&scan->devicesLock);
+   return scan;
+}
+
+/* Start a background scan of one card, or all cards if card is -1. Returns the scan: the caller unrefs it */
+static ASCONFIG_SCAN *run_scan(ASCONFIG_DEVICE_VIEW *deviceTreeview, gint card, gboolean useCache) {
+   ASCONFIG_SCAN *scan=scan_new(deviceTreeview, useCache, ! (passiveProbe || lazyProbe));
+   GTask *task;
+
+   scan->card=card;
+   task=g_task_new(NULL, scan->cancellable, scan_done, deviceTreeview);
+   g_task_set_task_data(task, scan_ref(scan), scan_unref);
+   g_task_run_in_thread(task, scan_thread);
+   g_object_unref(task);
+   return scan;
+}
+
+/* Probe the cards in the background: the device lists fill in as each device is probed
+ * useCache: take device parameters from the probe cache where possible
+ */
+static void start_scan(ASCONFIG_DEVICE_VIEW *deviceTreeview, gboolean useCache) {
+   if (currentScan!=NULL) { /* Abandon a running scan: its late results are dropped */
+      g_cancellable_cancel(currentScan->cancellable);
+      scan_unref(currentScan);
+   }
+   gtk_list_store_clear(GTK_LIST_STORE(gtk_tree_view_get_model(GTK_TREE_VIEW(deviceTreeview->playbackTreeview))));
+   gtk_list_store_clear(GTK_LIST_STORE(gtk_tree_view_get_model(GTK_TREE_VIEW(deviceTreeview->captureTreeview))));
+
+   currentScan=run_scan(deviceTreeview, -1, useCache);
+}
+
+/* Deep probe a single device on demand, e.g. one left unprobed by a passive or lazy scan */
+static void probe_device_thread(GTask *task, gpointer source_object, gpointer task_data, GCancellable *cancellable) {
+   ASCONFIG_DEVICE *device=task_data;
+   ASCONFIG_PROBE probe;
+   ASCONFIG_CARD cardInfo;
+   gint64 start=trace_begin();
+
+   snd_ctl_card_info_alloca(&probe.info);
+
+   if (probeBackend->card_open(&probe, device->card, &cardInfo)) {
+      probe_pcm_watchdog(device);
+      probe_usb_streams(&cardInfo, device);
+      if (device->formats!=0 && probeBackend->cache) { /* Only this device is merged into the file: see cache_save() */
+         device->scan->cache=g_key_file_new();
+         cache_store(device->scan, &cardInfo, device);
+         cache_save(device->scan);
+      }
+      if (probeBackend->probe_eld!=NULL)
+         probeBackend->probe_eld(&probe, device);
+      probeBackend->card_close(&probe, &cardInfo);
+   }
+   else
+      device->inUse="E";
+   if (g_strcmp0(device->inUse, "*")==0)
+      probe_running(device);
+   else
+      device->freeSubdevice=MAX(find_free_subdevice(device->card, device->dev, device->stream, device->subdevices), -1);
+   trace_end(start, "probe", device->hwdev, device->stream);
+   post_device(device);
+   g_task_return_boolean(task, TRUE);
+}
+
+static void start_device_probe(ASCONFIG_DEVICE_VIEW *deviceTreeview, snd_pcm_stream_t stream, GtkTreeIter *iter) {
+   GtkTreeModel *model=GTK_TREE_MODEL(gtk_tree_view_get_model(GTK_TREE_VIEW(stream==SND_PCM_STREAM_PLAYBACK ? deviceTreeview->playbackTreeview : deviceTreeview->captureTreeview)));
+   ASCONFIG_DEVICE *row=device_from_row(model, iter), *device;
+   GTask *task;
+
+   if (g_strcmp0(row->inUse, ASCONFIG_STATE_PROBING)!=0) {
+      /* Probe a fresh record with the row's identity: the row keeps showing its own until the results arrive */
+      device=device_new();
+      device->scan=scan_new(deviceTreeview, FALSE, TRUE);
+      device->stream=stream;
+      device->card=row->card;
+      device->dev=row->dev;
+      device->cardInfo=row->cardInfo;
+      device->devID=g_strdup(row->devID);
+      device->devName=g_strdup(row->devName);
+      device->subdevices=row->subdevices;
+      device->subdevicesAvail=row->subdevicesAvail;
+      snprintf(device->hwdev, 64, "%s", row->hwdev);
+      row_set_in_use(model, iter, ASCONFIG_STATE_PROBING);
+
+      task=g_task_new(NULL, device->scan->cancellable, NULL, NULL);
+      g_task_set_task_data(task, device, (GDestroyNotify)device_unref);
+      g_task_run_in_thread(task, probe_device_thread);
+      g_object_unref(task);
+   }
+}
+
+/* Benchmark (--bench): time full deep scans of the mock backend at each size in
+ * benchDevices, without GTK. Probe latencies are taken from the trace's probe spans.
+ */
+static gint run_bench(void) {
+   static const guint benchDevices[]={ 1, 16, 64, 256 };
+   ASCONFIG_SCAN *scan;
+   ASCONFIG_TRACE_EVENT *event;
+   guint size, scans, pcms, probes, i, first;
+   gint64 start, elapsed, probeTime, maxProbeTime;
+
+   probeBackend=&mockBackend;
+   if (probeTrace==NULL)
+      probeTrace=trace_new(NULL);
+   printf("Mock pcms: %d ms to open, %d%% busy, %d%% errors; probe timeout %d ms\n",
+            mockConfig.latency, mockConfig.busy, mockConfig.error, probeTimeout);
+   for (size=0; size<G_N_ELEMENTS(benchDevices); size++) {
+      mockConfig.devices=MIN(benchDevices[size], 8);
+      mockConfig.cards=benchDevices[size]/mockConfig.devices;
+      pcms=2*mockConfig.cards*mockConfig.devices;
+
+      g_mutex_lock(&probeTrace->lock);
+      first=probeTrace->events->len;
+      g_mutex_unlock(&probeTrace->lock);
+      scans=0;
+      start=g_get_monotonic_time();
+      do {
+         scan=scan_new(NULL, FALSE, TRUE);
+         scan_cards(scan);
+         scan_unref(scan);
+         scans++;
+         elapsed=g_get_monotonic_time()-start;
+      } while (elapsed<ASCONFIG_BENCH_TIME*G_TIME_SPAN_MILLISECOND);
+
+      probes=0;
+      probeTime=maxProbeTime=0;
+      g_mutex_lock(&probeTrace->lock);
+      for (i=first; i<probeTrace->events->len; i++) {
+         event=&g_array_index(probeTrace->events, ASCONFIG_TRACE_EVENT, i);
+         if (strcmp(event->name, "probe")==0) {
+            probes++;
+            probeTime+=event->duration;
+            maxProbeTime=MAX(maxProbeTime, event->duration);
+         }
+      }
+      g_mutex_unlock(&probeTrace->lock);
+
+      printf("%4u devices (%3u cards x %u): %8.2f scans/s, %8.3f ms/pcm wall, probe latency mean %.3f ms, max %.3f ms\n",
+               benchDevices[size], mockConfig.cards, mockConfig.devices, scans*1e6/elapsed, elapsed/1e3/scans/pcms,
+               probes ? probeTime/1e3/probes : 0.0, maxProbeTime/1e3);
+   }
+   if (probeTrace->filename!=NULL)
+      trace_save(probeTrace);
+   return 0;
+}
+
+/* Headless probe (--probe): scan without GTK and print every device's capabilities */
+static void json_append_string(GString *json, const gchar *value) {
+   const gchar *c;
+
+   if (value==NULL) {
+      g_string_append(json, "null");
+      return;
+   }
+   g_string_append_c(json, '"');
+   for (c=value; *c; c++) {
+      if (*c=='"' || *c=='\\')
+         g_string_append_printf(json, "\\%c", *c);
+      else if ((guchar)*c<0x20)
+         g_string_append_printf(json, "\\u%04x", (guchar)*c);
+      else
+         g_string_append_c(json, *c);
+   }
+   g_string_append_c(json, '"');
+}
+
+static void json_append_device(GString *json, const ASCONFIG_DEVICE *device) {
+   gchar **maps, *mapList;
+   guint i;
+
+   g_string_append_printf(json, "{ \"card\": %u, \"card_id\": ", device->card);
+   json_append_string(json, device->cardInfo ? device->cardInfo->ID : NULL);
+   g_string_append(json, ", \"card_name\": ");
+   json_append_string(json, device->cardInfo ? device->cardInfo->name : NULL);
+   g_string_append_printf(json, ", \"device\": %u, \"device_id\": ", device->dev);
+   json_append_string(json, device->devID);
+   g_string_append(json, ", \"device_name\": ");
+   json_append_string(json, device->devName);
+   g_string_append(json, ", \"hw\": ");
+   json_append_string(json, device->hwdev);
+   g_string_append(json, ", \"state\": ");
+   json_append_string(json, device->inUse); /* null: probed and free */
+   g_string_append_printf(json, ", \"subdevices\": %u, \"subdevices_avail\": %u", device->subdevices, device->subdevicesAvail);
+
+   if (device->formats!=0) {
+      g_string_append_printf(json, ",\n      \"min_channels\": %u, \"max_channels\": %u, \"min_rate\": %u, \"max_rate\": %u, \"formats\": [",
+                              device->min_ch, device->max_ch, device->min_sr, device->max_sr);
+      for (i=0; i<=SND_PCM_FORMAT_LAST; i++)
+         if (device->formats & ((guint64)1<<i))
+            g_string_append_printf(json, "%s\"%s\"", json->str[json->len-1]=='[' ? "" : ", ", snd_pcm_format_name((snd_pcm_format_t)i));
+      g_string_append(json, "], \"native_rates\": [");
+      for (i=0; i<G_N_ELEMENTS(standardRates); i++)
+         if (device->nativeRates & (1<<i))
+            g_string_append_printf(json, "%s%u", json->str[json->len-1]=='[' ? "" : ", ", standardRates[i]);
+      g_string_append_printf(json, "],\n      \"period_size\": [%u, %u], \"buffer_size\": [%u, %u], \"periods\": [%u, %u], \"access\": [",
+                              device->minPeriodSize, device->maxPeriodSize, device->minBufferSize, device->maxBufferSize, device->minPeriods, device->maxPeriods);
+      for (i=0; i<=SND_PCM_ACCESS_LAST; i++)
+         if (device->access & (1<<i))
+            g_string_append_printf(json, "%s\"%s\"", json->str[json->len-1]=='[' ? "" : ", ", snd_pcm_access_name((snd_pcm_access_t)i));
+      g_string_append_printf(json, "], \"batch\": %s, \"usb_sync\": ", device->batch ? "true" : "false");
+      json_append_string(json, device->usbSync);
+      g_string_append(json, ", \"channel_maps\": ");
+      if (device->chmaps!=NULL) {
+         maps=g_strsplit(device->chmaps, ";", -1);
+         mapList=g_strjoinv("\", \"", maps);
+         g_string_append_printf(json, "[\"%s\"]", mapList); /* Channel position names need no escaping */
+         g_free(mapList);
+         g_strfreev(maps);
+      }
+      else
+         g_string_append(json, "null");
+   }
+   if (device->defaultFormat!=SND_PCM_FORMAT_UNKNOWN) {
+      g_string_append_printf(json, ",\n      \"%s\": { \"format\": \"%s\", \"rate\": %u, \"channels\": %u",
+                              device->running ? "running" : "default", snd_pcm_format_name(device->defaultFormat),
+                              device->defaultRate, device->defaultChannels);
+      if (device->running)
+         g_string_append_printf(json, ", \"period_size\": %u, \"buffer_size\": %u", device->runningPeriodSize, device->runningBufferSize);
+      g_string_append(json, " }");
+   }
+   if (device->sink!=NULL) {
+      g_string_append(json, ", \"sink\": ");
+      json_append_string(json, device->sink);
+   }
+   if (device->owner!=NULL) {
+      g_string_append(json, ", \"owner\": ");
+      json_append_string(json, device->owner);
+   }
+   g_string_append(json, " }");
+}
+
+/* One CSV field, quoted when needed */
+static void csv_append_field(GString *csv, const gchar *value) {
+   gchar **parts, *quoted;
+
+   if (csv->len>0 && csv->str[csv->len-1]!='\n')
+      g_string_append_c(csv, ',');
+   if (value==NULL)
+      return;
+   if (strpbrk(value, ",\"\n")==NULL) {
+      g_string_append(csv, value);
+      return;
+   }
+   parts=g_strsplit(value, "\"", -1);
+   quoted=g_strjoinv("\"\"", parts);
+   g_string_append_printf(csv, "\"%s\"", quoted);
+   g_free(quoted);
+   g_strfreev(parts);
+}
+
+/* Rows from parallel card scans arrive in any order */
+static gint device_order(gconstpointer a, gconstpointer b) {
+   const ASCONFIG_DEVICE *deviceA=*(ASCONFIG_DEVICE * const *)a, *deviceB=*(ASCONFIG_DEVICE * const *)b;
+
+   if (deviceA->stream!=deviceB->stream)
+      return (gint)deviceA->stream-(gint)deviceB->stream;
+   if (deviceA->card!=deviceB->card)
+      return (gint)deviceA->card-(gint)deviceB->card;
+   return (gint)deviceA->dev-(gint)deviceB->dev;
+}
+
+/* Scan the cards as the GUI would, deep unless --passive, and print the devices of
+ * both directions to stdout: JSON, or CSV with the device list's columns.
+ */
+static gint run_probe(gboolean csv) {
+   ASCONFIG_SCAN *scan;
+   ASCONFIG_DEVICE *device;
+   GString *out=g_string_new(NULL);
+   snd_pcm_stream_t stream;
+   guint i, column;
+   gchar *text;
+
+   scan=scan_new(NULL, ASCONFIG_PROBE_CACHE, ! passiveProbe);
+   scan->devices=g_ptr_array_new_with_free_func((GDestroyNotify)device_unref);
+   scan_cards(scan);
+   g_ptr_array_sort(scan->devices, device_order);
+
+   if (csv) {
+      csv_append_field(out, "Stream");
+      for (column=0; column<NUM_VIEW_COLUMNS; column++)
+         csv_append_field(out, column==VIEW_IN_USE ? "State" : viewHeadings[column]);
+      g_string_append_c(out, '\n');
+      for (i=0; i<scan->devices->len; i++) {
+         device=g_ptr_array_index(scan->devices, i);
+         csv_append_field(out, streamNames[device->stream]);
+         for (column=0; column<NUM_VIEW_COLUMNS; column++) {
+            text=device_column_text(device, column);
+            csv_append_field(out, text);
+            g_free(text);
+         }
+         g_string_append_c(out, '\n');
+      }
+   }
+   else {
+      g_string_append(out, "{");
+      for (stream=SND_PCM_STREAM_PLAYBACK; stream<=SND_PCM_STREAM_CAPTURE; stream++) {
+         g_string_append_printf(out, "%s\n  \"%s\": [", stream==SND_PCM_STREAM_PLAYBACK ? "" : ",", stream==SND_PCM_STREAM_PLAYBACK ? "playback" : "capture");
+         for (i=0; i<scan->devices->len; i++) {
+            device=g_ptr_array_index(scan->devices, i);
+            if (device->stream!=stream)
+               continue;
+            g_string_append_printf(out, "%s\n    ", out->str[out->len-1]=='[' ? "" : ",");
+            json_append_device(out, device);
+         }
+         g_string_append(out, "\n  ]");
+      }
+      g_string_append(out, "\n}\n");
+   }
+   fwrite(out->str, 1, out->len, stdout);
+   g_string_free(out, TRUE);
+   scan_unref(scan);
+   if (probeTrace!=NULL)
+      trace_save(probeTrace);
+   return 0;
+}
+
+/* Scheduling jitter
+ * An audio client sleeps until the next period is due. How late it wakes on this host
+ * decides the smallest period which can be used without xruns, so each candidate period
+ * is timed as cyclictest would: wakeups at absolute times, recording how late each one is.
+ */
+
+static int compare_guint(const void *a, const void *b) {
+   guint x=*(const guint *)a, y=*(const guint *)b;
+
+   return (x>y)-(x<y);
+}
+
+/* Wake every jitter->periodTime us, n times, and fill in the latency distribution */
+static void jitter_measure(ASCONFIG_JITTER *jitter, guint n) {
+   struct timespec next, now;
+   guint *late, i, worst;
+   gint64 delay;
+
+   late=g_new(guint, n);
+   clock_gettime(CLOCK_MONOTONIC, &next);
+   for (i=0; i<n; i++) {
+      next.tv_nsec+=(glong)jitter->periodTime*1000;
+      while (next.tv_nsec>=1000000000) {
+         next.tv_nsec-=1000000000;
+         next.tv_sec++;
+      }
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL)==EINTR)
+         ;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      delay=((gint64)(now.tv_sec-next.tv_sec)*1000000000+(now.tv_nsec-next.tv_nsec))/1000;
+      late[i]=CLAMP(delay, 0, G_MAXUINT);
+   }
+   qsort(late, n, sizeof(guint), compare_guint);
+   jitter->wakeups=n;
+   jitter->p50=late[n/2];
+   jitter->p99=late[(guint64)n*99/100];
+   jitter->p999=late[(guint64)n*999/1000];
+   jitter->max=late[n-1];
+   /* Late by less than the rest of the buffer, with headroom and time to fill it: the client refills it in time */
+   worst=(n<ASCONFIG_JITTER_SAMPLES) ? jitter->max : jitter->p999;
+   jitter->safe=((guint64)worst*ASCONFIG_JITTER_HEADROOM+ASCONFIG_JITTER_MARGIN < (guint64)jitter->periodTime*(ASCONFIG_LATENCY_PERIODS-1));
+   g_free(late);
+}
+
+/* Time the candidate periods smallest first until one is safe or ASCONFIG_JITTER_TIME
+ * is spent. progress: say on stderr which period is being timed, for the headless modes.
+ * Returns an ASCONFIG_JITTER for each period timed: the last is the safe one, if any.
+ */
+static GArray *measure_jitter(gboolean progress) {
+   GArray *results=g_array_new(FALSE, TRUE, sizeof(ASCONFIG_JITTER));
+   ASCONFIG_JITTER jitter;
+   guint64 left=(guint64)ASCONFIG_JITTER_TIME*1000; /* us */
+   guint i, n;
+
+   for (i=0; i<G_N_ELEMENTS(jitterPeriodTimes); i++) {
+      n=MIN(left/jitterPeriodTimes[i], ASCONFIG_JITTER_SAMPLES);
+      if (n<ASCONFIG_JITTER_MIN_SAMPLES)
+         break;
+      if (progress)
+         g_printerr("Timing %.1f ms periods: %u wakeups, %.1f s\n", jitterPeriodTimes[i]/1000.0, n, (gdouble)n*jitterPeriodTimes[i]/1e6);
+      memset(&jitter, 0, sizeof(ASCONFIG_JITTER));
+      jitter.periodTime=jitterPeriodTimes[i];
+      jitter_measure(&jitter, n);
+      left-=(guint64)n*jitter.periodTime;
+      g_array_append_val(results, jitter);
+      if (jitter.safe)
+         break;
+   }
+   return results;
+}
+
+/* The smallest safe period (us) of a measurement, 0 if none */
+static guint jitter_safe_period(GArray *results) {
+   const ASCONFIG_JITTER *last;
+
+   if (results->len==0)
+      return 0;
+   last=&g_array_index(results, ASCONFIG_JITTER, results->len-1);
+   return last->safe ? last->periodTime : 0;
+}
+
+/* One line per period timed, then the recommendation */
+static gchar *jitter_report(GArray *results) {
+   GString *report=g_string_new(NULL);
+   const ASCONFIG_JITTER *jitter;
+   guint i, period=jitter_safe_period(results);
+
+   for (i=0; i<results->len; i++) {
+      jitter=&g_array_index(results, ASCONFIG_JITTER, i);
+      g_string_append_printf(report, "Period %.1f ms: %u wakeups late by p50 %u us, p99 %u us, p99.9 %u us, max %u us: %s%s\n",
+                              jitter->periodTime/1000.0, jitter->wakeups, jitter->p50, jitter->p99, jitter->p999, jitter->max,
+                              jitter->safe ? "safe" : "too late", jitter->wakeups<ASCONFIG_JITTER_SAMPLES ? " (by max: too few wakeups for p99.9)" : "");
+   }
+   if (period>0)
+      g_string_append_printf(report, "Smallest safe period on this host: %.1f ms (%u periods, %.1f ms buffer)",
+                              period/1000.0, ASCONFIG_LATENCY_PERIODS, period*ASCONFIG_LATENCY_PERIODS/1000.0);
+   else if (results->len>0)
+      g_string_append_printf(report, "No period up to %.1f ms was safe in the %.0f s allowed",
+                              g_array_index(results, ASCONFIG_JITTER, results->len-1).periodTime/1000.0, ASCONFIG_JITTER_TIME/1000.0);
+   else
+      g_string_append(report, "No period was timed");
+   return g_string_free(report, FALSE);
+}
+
+/* Measure the scheduling jitter (--jitter) and print the report. Returns 1 if no period is safe. */
+static gint run_jitter(void) {
+   GArray *results=measure_jitter(TRUE);
+   gchar *report=jitter_report(results);
+   gint status=(jitter_safe_period(results)>0) ? 0 : 1;
+
+   printf("%s\n", report);
+   g_free(report);
+   g_array_unref(results);
+   return status;
+}
+
+/* Hotplug
+ * Cards are added and removed as their /dev/snd/controlC<N> nodes come and go. Only the
+ * card's rows are touched. A card is also rescanned when an HDMI/DP sink changes, as the
+ * driver constrains the pcm to what the sink accepts.
+ */
+static void hotplug_free(gpointer data) {
+   ASCONFIG_HOTPLUG *hotplug=data;
+
+   if (hotplug->fdSource!=0)
+      g_source_remove(hotplug->fdSource);
+   if (hotplug->rescanSource!=0)
+      g_source_remove(hotplug->rescanSource);
+   if (hotplug->ctl!=NULL)
+      snd_ctl_close(hotplug->ctl);
+   if (hotplug->scan!=NULL) {
+      g_cancellable_cancel(hotplug->scan->cancellable);
+      scan_unref(hotplug->scan);
+   }
+   g_free(hotplug);
+}
+
+static gboolean hotplug_ctl_event(gint fd, GIOCondition condition, gpointer user_data);
+
+/* Subscribe to the card's ctl events. Can fail until udev has set the permissions */
+static void hotplug_open(ASCONFIG_HOTPLUG *hotplug) {
+   gchar hwdev[64];
+   struct pollfd pfd;
+   gint err;
+
+   snprintf(hwdev, 64, "hw:%u", hotplug->card);
+   err=snd_ctl_open(&hotplug->ctl, hwdev, SND_CTL_NONBLOCK);
+   if (err!=0) {
+      hotplug->ctl=NULL;
+      return;
+   }
+   /* On failure close again, so that hotplug_rescan() retries */
+   err=snd_ctl_subscribe_events(hotplug->ctl, 1);
+   if (err!=0)
+      g_warning("Error watching card %s for changes: %s", hwdev, snd_strerror(err));
+   else if (snd_ctl_poll_descriptors(hotplug->ctl, &pfd, 1)!=1)
+      g_warning("Error watching card %s for changes: no single poll descriptor for its control device", hwdev);
+   else {
+      hotplug->fdSource=g_unix_fd_add(pfd.fd, G_IO_IN | G_IO_ERR | G_IO_HUP, hotplug_ctl_event, hotplug);
+      return;
+   }
+   snd_ctl_close(hotplug->ctl);
+   hotplug->ctl=NULL;
+}
+
+static gboolean hotplug_rescan(gpointer data) {
+   ASCONFIG_HOTPLUG *hotplug=data;
+
+   hotplug->rescanSource=0;
+   if (hotplug->ctl==NULL)
+      hotplug_open(hotplug);
+   if (hotplug->scan!=NULL) {
+      g_cancellable_cancel(hotplug->scan->cancellable);
+      scan_unref(hotplug->scan);
+   }
+   hotplug->scan=run_scan(hotplug->view, hotplug->card, hotplug->rescanUseCache);
+   return G_SOURCE_REMOVE;
+}
+
+/* useCache: FALSE if the card's capabilities may have changed */
+static void hotplug_schedule_rescan(ASCONFIG_HOTPLUG *hotplug, gboolean useCache) {
+   if (hotplug->rescanSource!=0) {
+      g_source_remove(hotplug->rescanSource);
+      useCache=useCache && hotplug->rescanUseCache;
+   }
+   hotplug->rescanUseCache=useCache;
+   hotplug->rescanSource=g_timeout_add(ASCONFIG_HOTPLUG_DELAY, hotplug_rescan, hotplug);
+}
+
+static gboolean hotplug_ctl_event(gint fd, GIOCondition condition, gpointer user_data) {
+   ASCONFIG_HOTPLUG *hotplug=user_data;
+   snd_ctl_event_t *event;
+   const gchar *name;
+   guint mask;
+   gint err;
+
+   snd_ctl_event_alloca(&event);
+   while ((err=snd_ctl_read(hotplug->ctl, event))>0) {
+      if (snd_ctl_event_get_type(event)!=SND_CTL_EVENT_ELEM)
+         continue;
+      mask=snd_ctl_event_elem_get_mask(event);
+      if (mask==SND_CTL_EVENT_MASK_REMOVE || ! (mask & (SND_CTL_EVENT_MASK_VALUE | SND_CTL_EVENT_MASK_ADD)))
+         continue;
+      name=snd_ctl_event_elem_get_name(event);
+      if (strstr(name, "ELD")!=NULL || (strstr(name, "Jack")!=NULL && (strstr(name, "HDMI")!=NULL || strstr(name, "DP")!=NULL)))
+         hotplug_schedule_rescan(hotplug, FALSE);
+   }
+   if ((err<0 && err!=-EAGAIN) || (condition & (G_IO_ERR | G_IO_HUP))) { /* Card is going away: the /dev/snd monitor removes its rows */
+      hotplug->fdSource=0;
+      return G_SOURCE_REMOVE;
+   }
+   return G_SOURCE_CONTINUE;
+}
+
+static ASCONFIG_HOTPLUG *hotplug_watch_card(ASCONFIG_DEVICE_VIEW *deviceTreeview, guint card) {
+   ASCONFIG_HOTPLUG *hotplug=g_new0(ASCONFIG_HOTPLUG, 1);
+
+   hotplug->card=card;
+   hotplug->view=deviceTreeview;
+   hotplug_open(hotplug);
+   g_hash_table_replace(hotplugCards, GUINT_TO_POINTER(card+1), hotplug);
+   return hotplug;
+}
+
+static void hotplug_dev_changed(GFileMonitor *monitor, GFile *file, GFile *otherFile, GFileMonitorEvent event, gpointer user_data) {
+   ASCONFIG_DEVICE_VIEW *deviceTreeview=user_data;
+   gchar *name=g_file_get_basename(file);
+   guint card;
+
+   if (sscanf(name, "controlC%u", &card)==1) {
+      if (event==G_FILE_MONITOR_EVENT_CREATED)
+         hotplug_schedule_rescan(hotplug_watch_card(deviceTreeview, card), TRUE);
+      else if (event==G_FILE_MONITOR_EVENT_DELETED) {
+         g_hash_table_remove(hotplugCards, GUINT_TO_POINTER(card+1));
+         remove_card_rows(GTK_LIST_STORE(gtk_tree_view_get_model(GTK_TREE_VIEW(deviceTreeview->playbackTreeview))), card);
+         remove_card_rows(GTK_LIST_STORE(gtk_tree_view_get_model(GTK_TREE_VIEW(deviceTreeview->captureTreeview))), card);
+      }
+   }
+   g_free(name);
+}
+
+static void hotplug_init(ASCONFIG_DEVICE_VIEW *deviceTreeview) {
+   GFile *dir=g_file_new_for_path("/dev/snd");
+   GError *error=NULL;
+   gint card=-1;
+
+   hotplugCards=g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, hotplug_free);
+   while (snd_card_next(&card)==0 && card>=0)
+      hotplug_watch_card(deviceTreeview, card);
+
+   hotplugMonitor=g_file_monitor_directory(dir, G_FILE_MONITOR_NONE, NULL, &error);
+   if (hotplugMonitor==NULL) {
+      g_warning("Error watching /dev/snd for new cards: %s", error->message);
+      g_error_free(error);
+   }
+   else
+      g_signal_connect(hotplugMonitor, "changed", G_CALLBACK(hotplug_dev_changed), deviceTreeview);
+   g_object_unref(dir);
+}
+
+/* Channel maps and routing
+ * dmix and dsnoop bindings put the device's channels in alsa's standard order, so
+ * clients see FL FR RL RR FC LFE SL SR whatever the hardware order is. Stereo to
+ * surround and back is done by a route pcm with a fixed ttable.
+ */
+static gboolean standard_channels(guint channels) {
+   return (channels==2 || channels==4 || channels==6 || channels==8);
+}
+
+/* bindings[i]: device channel for alsa's standard channel i. Returns FALSE with
+ * one to one bindings if the device's map is not known or lacks a standard position
+ */
+static gboolean chmap_bindings(gchar **positions, guint channels, guint *bindings) {
+   guint i, j;
+
+   for (i=0; i<channels; i++)
+      bindings[i]=i;
+   if (positions==NULL || ! standard_channels(channels))
+      return FALSE;
+   for (i=0; i<channels; i++) {
+      for (j=0; j<channels && strcmp(positions[j], standardPositions[i])!=0; j++);
+      if (j==channels) {
+         for (i=0; i<channels; i++)
+            bindings[i]=i;
+         return FALSE;
+      }
+      bindings[i]=j;
+   }
+   return TRUE;
+}
+
+/* Channel positions seen by a route pcm on the slave: alsa's standard order if
+ * bindings put the device in it or the device has no map, otherwise the device's
+ * own. NULL if not known. Free with g_strfreev()
+ */
+static gchar **route_positions(gchar **positions, guint channels, gboolean bound) {
+   gchar **standard;
+   guint i;
+
+   if ((bound || positions==NULL) && standard_channels(channels)) {
+      standard=g_new0(gchar *, channels+1);
+      for (i=0; i<channels; i++)
+         standard[i]=g_strdup(standardPositions[i]);
+      return standard;
+   }
+   return g_strdupv(positions);
+}
+
+/* Gain of the left (side 0) or right (side 1) stereo channel in a surround position */
+static gdouble upmix_gain(const gchar *position, guint side) {
+   static const gchar * const sides[2][4]={ { "FL", "RL", "SL", NULL }, { "FR", "RR", "SR", NULL } };
+
+   if (g_strv_contains(sides[side], position))
+      return 1.0;
+   if (strcmp(position, "FC")==0 || strcmp(position, "RC")==0 || strcmp(position, "MONO")==0)
+      return 0.5;
+   return 0.0; /* LFE is not fed from full range channels */
+}
+
+/* Gain of a surround position in the left (side 0) or right (side 1) stereo channel, ITU style */
+static gdouble downmix_gain(const gchar *position, guint side) {
+   static const gchar * const sides[2][3]={ { "RL", "SL", NULL }, { "RR", "SR", NULL } };
+
+   if (strcmp(position, side ? "FR" : "FL")==0)
+      return 1.0;
+   if (g_strv_contains(sides[side], position) || strcmp(position, "FC")==0 || strcmp(position, "RC")==0 || strcmp(position, "MONO")==0)
+      return 0.707;
+   return 0.0;
+}
+
+/* Write a route pcm between stereo and the surround positions
+ * upmix: stereo client, surround slave. Otherwise a surround client (playback)
+ * or slave (capture) is mixed down to stereo, scaled so it can't clip.
+ */
+static void add_route(FILE *asoundrcFD, const gchar *comment, gchar *pcmName, gchar *slavePCM, gchar **positions, gboolean upmix, snd_pcm_stream_t stream) {
+   guint channels=g_strv_length(positions), side, i;
+   gdouble gain, total;
+
+   fprintf(asoundrcFD, "# %s\n"
+                       "pcm.!%s {\n"
+                       "   type route\n"
+                       "   slave {\n"
+                       "      pcm %s\n"
+                       "      channels %u\n"
+                       "   }\n"
+                       "   ttable {\n", comment, pcmName, slavePCM, (upmix || stream==SND_PCM_STREAM_CAPTURE) ? channels : 2);
+   if (upmix) { /* client.side slave.position */
+      for (side=0; side<2; side++) {
+         fprintf(asoundrcFD, "      %u {", side);
+         for (i=0; i<channels; i++)
+            if ((gain=upmix_gain(positions[i], side))>0)
+               fprintf(asoundrcFD, " %u %g", i, gain);
+         fprintf(asoundrcFD, " }\n");
+      }
+   }
+   else {
+      total=1.0; /* Normalise by the louder side: both are the same for standard maps */
+      for (side=0; side<2; side++) {
+         for (i=0, gain=0; i<channels; i++)
+            gain+=downmix_gain(positions[i], side);
+         total=MAX(total, gain);
+      }
+      if (stream==SND_PCM_STREAM_PLAYBACK) { /* client.position slave.side */
+         for (i=0; i<channels; i++) {
+            if (downmix_gain(positions[i], 0)==0 && downmix_gain(positions[i], 1)==0)
+               continue; /* e.g. LFE */
+            fprintf(asoundrcFD, "      %u {", i);
+            for (side=0; side<2; side++)
+               if ((gain=downmix_gain(positions[i], side))>0)
+                  fprintf(asoundrcFD, " %u %.3f", side, gain/total);
+            fprintf(asoundrcFD, " }\n");
+         }
+      }
+      else { /* client.side slave.position */
+         for (side=0; side<2; side++) {
+            fprintf(asoundrcFD, "      %u {", side);
+            for (i=0; i<channels; i++)
+               if ((gain=downmix_gain(positions[i], side))>0)
+                  fprintf(asoundrcFD, " %u %.3f", i, gain/total);
+            fprintf(asoundrcFD, " }\n");
+         }
+      }
+   }
+   fprintf(asoundrcFD, "   }\n"
+                       "}\n");
+}
+
+static void add_bindings(FILE *asoundrcFD, const guint *bindings, guint channels) {
+   guint i;
+
+   fprintf(asoundrcFD, "   bindings {\n");
+   for (i=0; i<channels; i++)
+      fprintf(asoundrcFD, "      %u %u\n", i, bindings[i]);
+   fprintf(asoundrcFD, "   }\n");
+}
+
+/* Buffer latency (ms) of the config's latency profile */
+static guint config_latency(const ASCONFIG_CONFIG *config) {
+   if (latencyProfileTimes[config->latencyProfile]==0)
+      return config->latency;
+   return latencyProfileTimes[config->latencyProfile];
+}
+
+/* Period time (us) for a buffer latency of latency ms, or the measured period if the config has one */
+static guint config_period_time(const ASCONFIG_CONFIG *config, guint latency) {
+   if (config->tunedPeriodTime>0)
+      return config->tunedPeriodTime;
+   return latency*1000/ASCONFIG_LATENCY_PERIODS;
+}
+
+/* Period and buffer sizes (frames) for periods of periodTime us at rate, in
+ * ASCONFIG_LATENCY_PERIODS periods, clamped to the device's probed period, periods and
+ * buffer limits: if the buffer is out of range the period count gives way first, within
+ * its limits, then the period size. The limits are not known for unprobed devices: the
+ * sizes are left as computed.
+ */
+static void latency_sizes(const ASCONFIG_DEVICE *device, guint rate, guint periodTime, guint *periodSize, guint *bufferSize, guint *periods) {
+   guint period, count, minCount=2, maxCount=G_MAXUINT;
+
+   period=MAX((guint64)rate*periodTime/1000000, 16);
+   if (device->maxPeriodSize>0)
+      period=CLAMP(period, device->minPeriodSize, device->maxPeriodSize);
+   if (device->maxPeriods>0) {
+      minCount=CLAMP(2, device->minPeriods, device->maxPeriods);
+      maxCount=device->maxPeriods;
+   }
+   count=CLAMP(ASCONFIG_LATENCY_PERIODS, minCount, maxCount);
+   if (device->maxBufferSize>0) {
+      if ((guint64)period*count>device->maxBufferSize) {
+         count=MAX(device->maxBufferSize/period, minCount);
+         if ((guint64)period*count>device->maxBufferSize)
+            period=MAX(device->maxBufferSize/count, device->minPeriodSize);
+      }
+      if ((guint64)period*count<device->minBufferSize) {
+         count=MIN((device->minBufferSize+period-1)/period, maxCount);
+         if ((guint64)period*count<device->minBufferSize) {
+            period=(device->minBufferSize+count-1)/count;
+            if (device->maxPeriodSize>0)
+               period=MIN(period, device->maxPeriodSize);
+         }
+      }
+   }
+   *periodSize=period;
+   *periods=count;
+   *bufferSize=period*count;
+}
+
+/* The timing options of config for a dmix or dsnoop pcm on device, as lines of its block
+ * A batch device's pointer only moves once a period: by default it is read with slowptr,
+ * and hw_ptr_alignment auto keeps the clients' periods aligned to it.
+ */
+static gchar *timing_options(const ASCONFIG_CONFIG *config, const ASCONFIG_DEVICE *device) {
+   GString *options=g_string_new(NULL);
+
+   if (config->slowptr!=0)
+      g_string_append_printf(options, "   slowptr %s\n", slowptrModes[config->slowptr]);
+   else if (device->batch)
+      g_string_append(options, "   slowptr yes\n");
+   if (config->hwPtrAlignment!=0)
+      g_string_append_printf(options, "   hw_ptr_alignment %s\n", hwPtrAlignments[config->hwPtrAlignment]);
+   else if (device->batch)
+      g_string_append(options, "   hw_ptr_alignment auto\n");
+   if (config->tstampType!=0)
+      g_string_append_printf(options, "   tstamp_type %s\n", tstampTypes[config->tstampType]);
+   if (config->varPeriodsize)
+      g_string_append(options, "   var_periodsize yes\n");
+   return g_string_free(options, FALSE);
 }
 
-// TODO: channels and bindings?
-static void add_dsnoop(FILE *asoundrcFD, gchar *pcmName, gchar *slavePCM, gchar *defaultFormat, guint defaultChannels, guint defaultRate) {
+/* periodSize, bufferSize: from the capture latency, or to match a running device
+ * periods: 0 to leave to alsa-lib
+ * timing: the timing options, see timing_options()
+ * bindings: defaultChannels entries, see chmap_bindings()
+ */
+static void add_dsnoop(FILE *asoundrcFD, gchar *pcmName, gchar *slavePCM, const gchar *defaultFormat, guint defaultChannels, guint defaultRate, guint periodSize, guint bufferSize, guint periods, const gchar *timing, const guint *bindings) {
    fprintf(asoundrcFD, "# Allow capture by multiple applications.\n"
                        "pcm.!%s {\n"
                        "   type dsnoop\n"
                        "   ipc_key 17022021\n"
                        "   ipc_key_add_uid yes\n"
+                       "%s"
                        "   slave {\n"
                        "      pcm \"%s\"\n"
-                       "      period_size 1024\n"
-                       "      buffer_size 4096\n"
+                       "      period_size %u\n"
+                       "      buffer_size %u\n"
                        "      format %s\n"
                        "      rate %u\n"
                        "      channels %u\n"
-                       "      periods 0\n"
+                       "      periods %u\n"
                        "      period_time 0\n"
-                       "   }\n"
-                       "   bindings {\n"
-                       "      0 0\n"
-                       "      1 1\n"
-                       "   }\n"
-                       "}\n", pcmName, slavePCM, defaultFormat, defaultRate, defaultChannels);
+                       "   }\n", pcmName, timing, slavePCM, periodSize, bufferSize, defaultFormat, defaultRate, defaultChannels, periods);
+   add_bindings(asoundrcFD, bindings, defaultChannels);
+   fprintf(asoundrcFD, "}\n");
 }
 
 static void add_dmixStream(FILE *asoundrcFD, gchar *pcmName, gchar *dmixPCM, gchar *streamPCM) {
@@ -317,29 +2905,85 @@ static void add_streamOut(FILE *asoundrcFD, gchar *pcmName, const gchar *streamF
                        "}\n", pcmName, streamFormat, streamSlavePCM, streamCommand);
 }
 
-static void add_plug(FILE *asoundrcFD, gchar *pcmName, gchar *slavePCM) {
+/* channels: 0 to leave to plug, otherwise fix the slave's channels, e.g. for a route pcm */
+static void add_plug(FILE *asoundrcFD, gchar *pcmName, gchar *slavePCM, guint channels) {
    fprintf(asoundrcFD, "# Convert formats (bit depth) and sample rates.\n"
                        "pcm.!%s {\n"
                        "   type plug\n"
                        "   slave {\n"
-                       "      pcm %s\n"
-                       "   }\n"
-                       "}\n", pcmName, slavePCM);
+                       "      pcm %s\n", pcmName, slavePCM);
+   if (channels>0)
+      fprintf(asoundrcFD, "      channels %u\n", channels);
+   fprintf(asoundrcFD, "   }\n"
+                       "}\n");
 }
 
-static void add_dmix(FILE *asoundrcFD, gchar *pcmName, gchar *slavePCM, gchar *defaultFormat, guint defaultChannels, guint defaultRate) {
+/* periodSize, bufferSize: 0 to leave to alsa-lib, otherwise from the latency profile or to match a running device
+ * periods: 0 to leave to alsa-lib
+ * timing: the timing options, see timing_options()
+ * bindings: defaultChannels entries, see chmap_bindings()
+ */
+static void add_dmix(FILE *asoundrcFD, gchar *pcmName, gchar *slavePCM, const gchar *defaultFormat, guint defaultChannels, guint defaultRate, guint periodSize, guint bufferSize, guint periods, const gchar *timing, const guint *bindings) {
    fprintf(asoundrcFD, "# Mix streams from several sources.\n"
                        "pcm.!%s {\n"
                        "   type dmix\n"
                        "   ipc_key 16022021\n"
                        "   ipc_key_add_uid yes\n"
+                       "%s"
                        "   slave {\n"
                        "      pcm %s\n"
                        "      format %s\n"
                        "      channels %u\n"
-                       "      rate %u\n"
-                       "   }\n"
-                       "}\n", pcmName, slavePCM, defaultFormat, defaultChannels, defaultRate);
+                       "      rate %u\n", pcmName, timing, slavePCM, defaultFormat, defaultChannels, defaultRate);
+   if (periodSize>0 && bufferSize>0)
+      fprintf(asoundrcFD, "      period_size %u\n"
+                          "      buffer_size %u\n", periodSize, bufferSize);
+   if (periods>0)
+      fprintf(asoundrcFD, "      periods %u\n"
+                          "      period_time 0\n", periods);
+   fprintf(asoundrcFD, "   }\n");
+   add_bindings(asoundrcFD, bindings, defaultChannels);
+   fprintf(asoundrcFD, "}\n");
+}
+
+/* Opt-in fixed channel conversions in front of slavePCM for playback: stereo sources can
+ * be upmixed to a surround device, and 5.1 / 7.1 sources mixed down to a stereo device.
+ * The default pcm does not use them: it passes the client's channels through.
+ * positions: channel positions of slavePCM.
+ */
+static void add_playback_routes(FILE *asoundrcFD, gchar *slavePCM, gchar **positions) {
+   guint channels=positions ? g_strv_length(positions) : 0, n;
+   gchar pcmName[32], routeName[32], comment[64], **sourcePositions;
+
+   if (channels>=6) {
+      fprintf(asoundrcFD, "# Play stereo sources to the upmix pcm to fill all %u channels.\n", channels);
+      add_plug(asoundrcFD, "upmix", "upmixRoute", 0);
+      add_route(asoundrcFD, "Fixed upmix of stereo sources to surround", "upmixRoute", slavePCM, positions, TRUE, SND_PCM_STREAM_PLAYBACK);
+   }
+   if (channels==2) {
+      for (n=6; n<=8; n+=2) {
+         snprintf(pcmName, sizeof(pcmName), "downmix%u1", n-1);
+         snprintf(routeName, sizeof(routeName), "downmix%u1Route", n-1);
+         snprintf(comment, sizeof(comment), "Fixed downmix of %u.1 sources to stereo", n-1);
+         fprintf(asoundrcFD, "# Play %u.1 sources to the %s pcm for a fixed downmix to stereo.\n", n-1, pcmName);
+         add_plug(asoundrcFD, pcmName, routeName, 0);
+         sourcePositions=route_positions(NULL, n, TRUE);
+         add_route(asoundrcFD, comment, routeName, slavePCM, sourcePositions, FALSE, SND_PCM_STREAM_PLAYBACK);
+         g_strfreev(sourcePositions);
+      }
+   }
+}
+
+/* subdevice: -1 to let alsa pick any free subdevice */
+static void add_hw(FILE *asoundrcFD, const gchar *comment, gchar *pcmName, guint card, guint dev, gint subdevice) {
+   fprintf(asoundrcFD, "# %s\n"
+                       "pcm.!%s {\n"
+                       "   type hw\n"
+                       "   card %u\n"
+                       "   device %u\n", comment, pcmName, card, dev);
+   if (subdevice>=0)
+      fprintf(asoundrcFD, "   subdevice %d\n", subdevice);
+   fprintf(asoundrcFD, "}\n");
 }
 
 static void add_default(FILE *asoundrcFD, gchar *playbackPCM, gchar *capturePCM) {
@@ -354,98 +2998,124 @@ static void add_default(FILE *asoundrcFD, gchar *playbackPCM, gchar *capturePCM)
    }
 }
 
-static void print_asoundrc(ASCONFIG_DEVICE_VIEW *deviceTreeview) {
-   gint resampler, playbackInterfaceType=-1, captureInterfaceType=-1;
-   gchar *defaultFormat=NULL, *captureFormat=NULL;
-   guint card, dev;
-   guint defaultRate, defaultChannels, min_ch, max_ch, min_sr, max_sr;
-   guint captureCard, captureDev, captureRate, captureChannels;
-   gchar slavePCM[16];
-   gchar defaultPlaybackPCM[16], *defaultCapturePCM=NULL; /* Selected pcm devices for defaults */
-   gchar *asoundrc;
-   gint response_id=GTK_RESPONSE_NO;
-   FILE *asoundrcFD;
-   gboolean streamSwitchState, streamDefault;
+/* Make sure the selected device has been deep probed: start the probe if needed and
+ * wait for it, keeping the main loop running. The window is insensitive meanwhile.
+ * Returns FALSE if nothing is selected, e.g. after a refresh.
+ */
+static gboolean wait_for_probe(ASCONFIG_DEVICE_VIEW *deviceTreeview, snd_pcm_stream_t stream) {
+   GtkWidget *treeview=(stream==SND_PCM_STREAM_PLAYBACK) ? deviceTreeview->playbackTreeview : deviceTreeview->captureTreeview;
+   GtkTreeSelection *selection=gtk_tree_view_get_selection(GTK_TREE_VIEW(treeview));
+   GtkTreeModel *model;
    GtkTreeIter iter;
-   GtkTreeModel *playbackModel, *captureModel;
-   GtkTreeSelection *playbackSelection, *captureSelection;
-   gchar *in_use;
-
-   //playbackModel=gtk_tree_view_get_model(GTK_TREE_VIEW(deviceTreeview->playbackTreeview));
-   playbackSelection=gtk_tree_view_get_selection(GTK_TREE_VIEW(deviceTreeview->playbackTreeview));
+   const gchar *in_use;
+   gboolean probing, selected;
 
-   if ( ! gtk_tree_selection_get_selected(playbackSelection, &playbackModel, &iter)) {
-      show_msgbox("No selected playback device: please select a playback device from the list: not writing asoundrc!", "asconfig", GTK_MESSAGE_INFO);
-      return;
-   }
-   gtk_tree_model_get(playbackModel, &iter, COLUMN_IN_USE, &in_use, -1);
-   if (in_use!=NULL) {
-      show_msgbox("The selected playback device is currently in use (blocked): not writing asoundrc!", "asconfig", GTK_MESSAGE_ERROR);
-      g_free(in_use);
-      return;
+   gtk_widget_set_sensitive(window, FALSE);
+   while ((selected=gtk_tree_selection_get_selected(selection, &model, &iter))) {
+      in_use=device_from_row(model, &iter)->inUse;
+      probing=(g_strcmp0(in_use, ASCONFIG_STATE_PROBING)==0);
+      if ( ! passiveProbe && g_strcmp0(in_use, ASCONFIG_STATE_NOT_PROBED)==0) {
+         start_device_probe(deviceTreeview, stream, &iter);
+         probing=TRUE;
+      }
+      if ( ! probing)
+         break;
+      g_main_context_iteration(NULL, TRUE);
    }
+   gtk_widget_set_sensitive(window, TRUE);
+   return selected;
+}
 
-   asoundrc=g_build_filename(g_get_home_dir(), ".asoundrc", NULL);
-   if (g_file_test(asoundrc, G_FILE_TEST_EXISTS)) {
-      response_id=show_actionbox("User alsa config file <i>.asoundrc</i> exists. <b>Overwrite?</b>", "Overwrite");
-      if (response_id==GTK_RESPONSE_NO)
-         return;
-   }
+/* dmix and dsnoop need mmap access to the hardware: offer plug for a device without it
+ * Returns FALSE if the user declines. interfaceType is set to plug if accepted.
+ */
+static gboolean check_mmap_access(GtkTreeModel *model, GtkTreeIter *iter, const gchar *streamType, const gchar *plugin, gint *interfaceType) {
+   guint access=device_from_row(model, iter)->access;
+   gchar *msg;
+   gint response_id;
+
+   if (access==0 || (access & ASCONFIG_ACCESS_MMAP)) /* Not known, e.g. a busy device, or supported */
+      return TRUE;
+
+   msg=g_markup_printf_escaped("The selected %s device does not support mmap access, which <b>%s</b> requires.\n"
+                               "Use plug instead? Only one application will be able to use the device at a time.", streamType, plugin);
+   response_id=show_actionbox(msg, "No mmap access");
+   g_free(msg);
+   if (response_id!=GTK_RESPONSE_YES)
+      return FALSE;
+   *interfaceType=1; /* plug */
+   return TRUE;
+}
+
+/* Write the config for the devices and options in config to asoundrcFD
+ * No dialogs: shared by the Save button and --generate.
+ */
+static void write_asoundrc(FILE *asoundrcFD, const ASCONFIG_CONFIG *config) {
+   const gchar *defaultFormat, *captureFormat=NULL;
+   guint card, dev;
+   guint defaultRate, defaultChannels, min_sr, max_sr;
+   guint captureCard, captureDev, captureRate, captureChannels;
+   gchar slavePCM[16];
+   gchar defaultPlaybackPCM[16], *defaultCapturePCM=NULL; /* Selected pcm devices for defaults */
+   const ASCONFIG_DEVICE *device;
+   guint periodSize, bufferSize, periods=0, capturePeriodSize=0, captureBufferSize=0, capturePeriods=0;
+   guint subdevices, captureSubdevices;
+   gint freeSubdevice, captureSubdevice;
+   gchar **positions, **capturePositions=NULL, **routePositions;
+   guint *bindings, *captureBindings=NULL;
+   gboolean bound, captureBound=FALSE;
+   gchar *timing;
+   const gchar *streamCommand=config->stubStream ? "/dev/null" : ASCONFIG_STREAM_COMMAND;
 
-   asoundrcFD=fopen(asoundrc, "w");
-   if (asoundrcFD==NULL) {
-      show_msgbox("Error opening .asoundrc for writing", "asconfig", GTK_MESSAGE_ERROR);
-      return;
-   }
    fprintf(asoundrcFD, "# User asoundrc file written by asconfig\n");
 
-   gtk_tree_model_get(playbackModel, &iter,
-               COLUMN_CARD, &card,
-               COLUMN_DEVICE, &dev,
-               COLUMN_DEVICE_MIN_CHANNELS, &min_ch,
-               COLUMN_DEVICE_MAX_CHANNELS, &max_ch,
-               COLUMN_DEVICE_MIN_RATE, &min_sr,
-               COLUMN_DEVICE_MAX_RATE, &max_sr,
-               COLUMN_DEFAULT_RATE, &defaultRate,
-               COLUMN_DEFAULT_FORMAT, &defaultFormat,
-               COLUMN_DEFAULT_CHANNELS, &defaultChannels,
-               -1);
+   device=config->playback;
+   card=device->card;
+   dev=device->dev;
+   min_sr=device->min_sr;
+   max_sr=device->max_sr;
+   defaultRate=device->defaultRate;
+   defaultFormat=(device->defaultFormat!=SND_PCM_FORMAT_UNKNOWN) ? snd_pcm_format_name(device->defaultFormat) : NULL;
+   defaultChannels=device->defaultChannels;
+   periodSize=device->runningPeriodSize;
+   bufferSize=device->runningBufferSize;
+   subdevices=device->subdevices;
+   freeSubdevice=device->freeSubdevice;
 
    /* If these are undefined for some reason fall back to hard coded defaults */
    if (defaultRate==0) defaultRate=ASCONFIG_DEFAULT_RATE;
-   if (defaultFormat==NULL) defaultFormat=g_strdup(ASCONFIG_DEFAULT_FORMAT_NAME);
+   if (defaultFormat==NULL) defaultFormat=ASCONFIG_DEFAULT_FORMAT_NAME;
    if (defaultChannels==0) defaultChannels=ASCONFIG_DEFAULT_CHANNELS;
+   positions=chmap_positions(device->chmaps, defaultChannels);
+   bindings=g_new(guint, defaultChannels);
+   bound=chmap_bindings(positions, defaultChannels, bindings);
 
-   resampler=gtk_combo_box_get_active(GTK_COMBO_BOX(asconfigControls.resampler));
-   playbackInterfaceType=gtk_combo_box_get_active(GTK_COMBO_BOX(asconfigControls.playbackInterface));
-   streamSwitchState=gtk_switch_get_active(GTK_SWITCH(asconfigControls.streamSwitch));
-   streamDefault=gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(asconfigControls.streamDefault));
-
-   //captureModel=gtk_tree_view_get_model(GTK_TREE_VIEW(deviceTreeview->captureTreeview));
-   captureSelection=gtk_tree_view_get_selection(GTK_TREE_VIEW(deviceTreeview->captureTreeview));
-   if (gtk_tree_selection_get_selected(captureSelection, &captureModel, &iter)==TRUE) {
-      gtk_tree_model_get(captureModel, &iter,
-            COLUMN_CARD, &captureCard,
-            COLUMN_DEVICE, &captureDev,
-            COLUMN_DEFAULT_RATE, &captureRate,
-            COLUMN_DEFAULT_FORMAT, &captureFormat,
-            COLUMN_DEFAULT_CHANNELS, &captureChannels,
-            -1);
+   if (config->capture!=NULL) {
+      device=config->capture;
+      captureCard=device->card;
+      captureDev=device->dev;
+      captureRate=device->defaultRate;
+      captureFormat=(device->defaultFormat!=SND_PCM_FORMAT_UNKNOWN) ? snd_pcm_format_name(device->defaultFormat) : NULL;
+      captureChannels=device->defaultChannels;
+      capturePeriodSize=device->runningPeriodSize;
+      captureBufferSize=device->runningBufferSize;
+      captureSubdevices=device->subdevices;
+      captureSubdevice=device->freeSubdevice;
       if (captureRate==0) captureRate=ASCONFIG_DEFAULT_RATE;
-      if (captureFormat==NULL) captureFormat=g_strdup(ASCONFIG_DEFAULT_FORMAT_NAME);
+      if (captureFormat==NULL) captureFormat=ASCONFIG_DEFAULT_FORMAT_NAME;
       if (captureChannels==0) captureChannels=ASCONFIG_DEFAULT_CHANNELS;
+      capturePositions=chmap_positions(device->chmaps, captureChannels);
+      captureBindings=g_new(guint, captureChannels);
+      captureBound=chmap_bindings(capturePositions, captureChannels, captureBindings);
 
       defaultCapturePCM=g_strdup("capture");
-      captureInterfaceType=gtk_combo_box_get_active(GTK_COMBO_BOX(asconfigControls.captureInterface));
-      fprintf(asoundrcFD, "# Selected capture device\n"
-                          "pcm.!%s {\n"
-                          "   type hw\n"
-                          "   card %u\n"
-                          "   device %u\n"
-                          "}\n", defaultCapturePCM, captureCard, captureDev);
+      add_hw(asoundrcFD, "Selected capture device", defaultCapturePCM, captureCard, captureDev, -1);
+      /* The default leaves alsa to pick a free subdevice: the one free when probed may not be free later */
+      if (config->captureInterface!=2 && captureSubdevices>1 && captureSubdevice>=0)
+         add_hw(asoundrcFD, "Selected capture device, pinned to the subdevice free when probed", "capturePinned", captureCard, captureDev, captureSubdevice);
    }  /* If nothing selected, captureInterfaceType=-1 and defaultCapturePCM=NULL */
 
-   switch (captureInterfaceType) {
+   switch (config->captureInterface) {
       case 0:  /* hw */
          fprintf(asoundrcFD,"# Direct hardware access selected - no software conversions.\n"
                             "# Only one application can use the capture device at a time.\n"
@@ -458,7 +3128,14 @@ static void print_asoundrc(ASCONFIG_DEVICE_VIEW *deviceTreeview) {
                              "# to match the hardware requirements. Only one application \n"
                              "# can use the capture device at a time.\n");
 
-         add_plug(asoundrcFD, "matchCapture", defaultCapturePCM);
+         routePositions=(captureChannels>=6) ? route_positions(capturePositions, captureChannels, FALSE) : NULL;
+         if (routePositions!=NULL) {
+            add_plug(asoundrcFD, "matchCapture", "downmixCapture", 2);
+            add_route(asoundrcFD, "Fixed downmix of surround capture to stereo", "downmixCapture", defaultCapturePCM, routePositions, FALSE, SND_PCM_STREAM_CAPTURE);
+         }
+         else
+            add_plug(asoundrcFD, "matchCapture", defaultCapturePCM, 0);
+         g_strfreev(routePositions);
          g_free(defaultCapturePCM); defaultCapturePCM=g_strdup("matchCapture");
       break;
       case 2:  /* dsnoop */
@@ -466,8 +3143,24 @@ static void print_asoundrc(ASCONFIG_DEVICE_VIEW *deviceTreeview) {
                              "# streams may be converted to a common format (bit depth)\n"
                              "# and sample rate using plug (dsnoop doesn't do conversions).\n");
 
-         add_plug(asoundrcFD, "matchCapture", "snoopCapture");
-         add_dsnoop(asoundrcFD, "snoopCapture", defaultCapturePCM, captureFormat, captureChannels, captureRate);
+         routePositions=(captureChannels>=6) ? route_positions(capturePositions, captureChannels, captureBound) : NULL;
+         if (routePositions!=NULL) {
+            add_plug(asoundrcFD, "matchCapture", "downmixCapture", 2);
+            add_route(asoundrcFD, "Fixed downmix of surround capture to stereo", "downmixCapture", "snoopCapture", routePositions, FALSE, SND_PCM_STREAM_CAPTURE);
+         }
+         else
+            add_plug(asoundrcFD, "matchCapture", "snoopCapture", 0);
+         g_strfreev(routePositions);
+         if (capturePeriodSize==0 || captureBufferSize==0) { /* Not running: size from the capture latency or measured period */
+            latency_sizes(config->capture, captureRate, config_period_time(config, config->captureLatency), &capturePeriodSize, &captureBufferSize, &capturePeriods);
+            fprintf(asoundrcFD, "# %s: %u periods of %u frames,\n"
+                                "# %.1f ms buffer at %u Hz.\n", config->tunedPeriodTime ? "Period measured on this host" : "Capture latency",
+                                 capturePeriods, capturePeriodSize,
+                                 captureBufferSize*1000.0/captureRate, captureRate);
+         }
+         timing=timing_options(config, config->capture);
+         add_dsnoop(asoundrcFD, "snoopCapture", defaultCapturePCM, captureFormat, captureChannels, captureRate, capturePeriodSize, captureBufferSize, capturePeriods, timing, captureBindings);
+         g_free(timing);
          g_free(defaultCapturePCM); defaultCapturePCM=g_strdup("matchCapture");
       break;
       default:
@@ -477,12 +3170,9 @@ static void print_asoundrc(ASCONFIG_DEVICE_VIEW *deviceTreeview) {
 
    /* Common setup */
    strcpy(defaultPlaybackPCM, "playback");
-   fprintf(asoundrcFD, "# Selected playback device\n"
-                       "pcm.!%s {\n"
-                       "   type hw\n"
-                       "   card %u\n"
-                       "   device %u\n"
-                       "}\n", defaultPlaybackPCM, card, dev);
+   add_hw(asoundrcFD, "Selected playback device", defaultPlaybackPCM, card, dev, -1);
+   if (config->playbackInterface!=2 && subdevices>1 && freeSubdevice>=0)
+      add_hw(asoundrcFD, "Selected playback device, pinned to the subdevice free when probed", "playbackPinned", card, dev, freeSubdevice);
 
    if (min_sr>0 && min_sr==max_sr) {
       fprintf(asoundrcFD, "# Force parameters for playback on single rate cards\n"
@@ -497,7 +3187,7 @@ static void print_asoundrc(ASCONFIG_DEVICE_VIEW *deviceTreeview) {
    fprintf(asoundrcFD, "# Default rate converter for plug and dmix\n"
                        "# Make sure package alsa-plugins is installed to use\n"
                        "# higher quality speexrate_medium resampling.\n"
-                       "defaults.pcm.rate_converter \"%s\"\n", resamplers[resampler]);
+                       "defaults.pcm.rate_converter \"%s\"\n", resamplers[config->resampler]);
 
    fprintf(asoundrcFD, "# Selected card mixer controls\n"
                        "ctl.!default {\n"
@@ -506,20 +3196,20 @@ static void print_asoundrc(ASCONFIG_DEVICE_VIEW *deviceTreeview) {
                        "}\n", card);
    /* End of common setup */
 
-   switch (playbackInterfaceType) {
+   switch (config->playbackInterface) {
       case 0:  /* hw */
          fprintf(asoundrcFD,"# Direct hardware access selected - no software conversions.\n"
                             "# Only one application can use the playback device at a time.\n"
                             "# Playback sample rates / formats / channels *MUST* match\n"
                             "# the cards native ranges, otherwise playback will fail.\n");
-         if (streamSwitchState==TRUE) {
-            if (streamDefault==TRUE) {
+         if (config->stream) {
+            if (config->streamDefault) {
                strcpy(slavePCM, defaultPlaybackPCM);
                strcpy(defaultPlaybackPCM, "stream");
             }
             else
                strcpy(slavePCM, "null");
-            add_streamOut(asoundrcFD, "stream", ASCONFIG_STREAM_INPUT_FORMAT, slavePCM, ASCONFIG_STREAM_COMMAND);
+            add_streamOut(asoundrcFD, "stream", ASCONFIG_STREAM_INPUT_FORMAT, slavePCM, streamCommand);
          }
          add_default(asoundrcFD, defaultPlaybackPCM, defaultCapturePCM);
       break;
@@ -528,28 +3218,43 @@ static void print_asoundrc(ASCONFIG_DEVICE_VIEW *deviceTreeview) {
                              "# may be changed and / or resampling may take place in order\n"
                              "# to match the hardware requirements. Only one application \n"
                              "# can use the playback device at a time.\n");
-         if (streamSwitchState==TRUE) {
-            if (streamDefault==TRUE) {
+         if (config->stream) {
+            if (config->streamDefault) {
                strcpy(slavePCM, defaultPlaybackPCM);
                strcpy(defaultPlaybackPCM, "stream");
             }
             else
                strcpy(slavePCM, "null");
-            add_streamOut(asoundrcFD, "stream", ASCONFIG_STREAM_INPUT_FORMAT, slavePCM, ASCONFIG_STREAM_COMMAND);
+            add_streamOut(asoundrcFD, "stream", ASCONFIG_STREAM_INPUT_FORMAT, slavePCM, streamCommand);
          }
-         add_plug(asoundrcFD, "match", defaultPlaybackPCM);
+         routePositions=route_positions(positions, defaultChannels, FALSE);
+         add_playback_routes(asoundrcFD, defaultPlaybackPCM, routePositions);
+         add_plug(asoundrcFD, "match", defaultPlaybackPCM, 0);
+         g_strfreev(routePositions);
          add_default(asoundrcFD, "match", defaultCapturePCM);
       break;
       case 2:  /* dmix */
          fprintf(asoundrcFD, "# Allow playback from multiple applications at once. Input\n"
                              "# streams may be converted to a common format (bit depth)\n"
                              "# and sample rate using plug (dmix doesn't do conversions).\n");
-         if (streamSwitchState==TRUE) {
+         if (config->stream) {
             add_dmixStream(asoundrcFD, "streamvol", "mix", "stream");
-            add_streamOut(asoundrcFD, "stream", ASCONFIG_STREAM_INPUT_FORMAT, "streamvol", ASCONFIG_STREAM_COMMAND);
+            add_streamOut(asoundrcFD, "stream", ASCONFIG_STREAM_INPUT_FORMAT, "streamvol", streamCommand);
          }
-         add_plug(asoundrcFD, "match", "mix");
-         add_dmix(asoundrcFD, "mix", defaultPlaybackPCM, defaultFormat, defaultChannels, defaultRate);
+         routePositions=route_positions(positions, defaultChannels, bound);
+         add_playback_routes(asoundrcFD, "mix", routePositions);
+         add_plug(asoundrcFD, "match", "mix", 0);
+         g_strfreev(routePositions);
+         if (periodSize==0 || bufferSize==0) { /* Not running: size from the latency profile or measured period */
+            latency_sizes(config->playback, defaultRate, config_period_time(config, config_latency(config)), &periodSize, &bufferSize, &periods);
+            fprintf(asoundrcFD, "# %s %s: %u periods of %u frames,\n"
+                                "# %.1f ms buffer at %u Hz.\n", config->tunedPeriodTime ? "Period measured on this host, not profile" : "Latency profile",
+                                 latencyProfiles[config->latencyProfile], periods, periodSize,
+                                 bufferSize*1000.0/defaultRate, defaultRate);
+         }
+         timing=timing_options(config, config->playback);
+         add_dmix(asoundrcFD, "mix", defaultPlaybackPCM, defaultFormat, defaultChannels, defaultRate, periodSize, bufferSize, periods, timing, bindings);
+         g_free(timing);
          add_default(asoundrcFD, "match", defaultCapturePCM);
       break;
       default:
@@ -557,12 +3262,555 @@ static void print_asoundrc(ASCONFIG_DEVICE_VIEW *deviceTreeview) {
          add_default(asoundrcFD, defaultPlaybackPCM, defaultCapturePCM);
       break;
    }  
-   fclose(asoundrcFD);
 
    g_free(defaultCapturePCM);
-   g_free(defaultFormat);
-   g_free(captureFormat);
+   g_strfreev(positions);
+   g_strfreev(capturePositions);
+   g_free(bindings);
+   g_free(captureBindings);
+}
+
+/* The config as text, see write_asoundrc(). The caller frees it. */
+static gchar *asoundrc_text(const ASCONFIG_CONFIG *config, gsize *length) {
+   gchar *text=NULL;
+   size_t size=0;
+   FILE *memFD=open_memstream(&text, &size);
+
+   if (memFD==NULL)
+      return NULL;
+   write_asoundrc(memFD, config);
+   fclose(memFD);
+   *length=size;
+   return text;
+}
+
+/* Open the default pcm of alsaConfig for stream as a client would, at rate and format in stereo,
+ * and play silence (or capture) for duration ms. Appends what was negotiated to report.
+ * Returns FALSE if the pcm fails to open, configure or run.
+ */
+static gboolean validate_pcm(snd_config_t *alsaConfig, snd_pcm_stream_t stream, guint rate, snd_pcm_format_t format, guint duration, GString *report) {
+   snd_pcm_t *pcm;
+   snd_pcm_hw_params_t *pars;
+   snd_pcm_uframes_t periodSize, bufferSize;
+   snd_pcm_sframes_t frames, delay=0;
+   guint actualRate=rate, channels=2, xruns=0;
+   gsize total, done=0;
+   gint err;
+   gpointer buffer;
+
+   snd_pcm_hw_params_alloca(&pars);
+   g_string_append_printf(report, "%s %u Hz %s: ", streamNames[stream], rate, snd_pcm_format_name(format));
+   /* Non-blocking: a blocking open waits for as long as the hw device under dmix/dsnoop is busy */
+   err=snd_pcm_open_lconf(&pcm, "default", stream, SND_PCM_NONBLOCK, alsaConfig);
+   if (err==-EBUSY || err==-EAGAIN) {
+      g_string_append(report, "device busy, not validated\n");
+      return FALSE;
+   }
+   if (err<0) {
+      g_string_append_printf(report, "can't open the default pcm: %s\n", snd_strerror(err));
+      return FALSE;
+   }
+   snd_pcm_nonblock(pcm, 0);
+   if ((err=snd_pcm_hw_params_any(pcm, pars))<0 ||
+       (err=snd_pcm_hw_params_set_access(pcm, pars, SND_PCM_ACCESS_RW_INTERLEAVED))<0 ||
+       (err=snd_pcm_hw_params_set_format(pcm, pars, format))<0 ||
+       (err=snd_pcm_hw_params_set_channels_near(pcm, pars, &channels))<0 ||
+       (err=snd_pcm_hw_params_set_rate_near(pcm, pars, &actualRate, NULL))<0 ||
+       (err=snd_pcm_hw_params(pcm, pars))<0) {
+      g_string_append_printf(report, "%s\n", snd_strerror(err));
+      snd_pcm_close(pcm);
+      return FALSE;
+   }
+   snd_pcm_hw_params_get_period_size(pars, &periodSize, NULL);
+   snd_pcm_hw_params_get_buffer_size(pars, &bufferSize);
+
+   buffer=g_malloc(snd_pcm_frames_to_bytes(pcm, periodSize));
+   snd_pcm_format_set_silence(format, buffer, periodSize*channels);
+   total=(gsize)actualRate*duration/1000;
+   while (done<total) {
+      if (stream==SND_PCM_STREAM_PLAYBACK)
+         frames=snd_pcm_writei(pcm, buffer, periodSize);
+      else
+         frames=snd_pcm_readi(pcm, buffer, periodSize);
+      if (frames==-EPIPE)
+         xruns++;
+      if (frames<0 && (err=snd_pcm_recover(pcm, frames, 1))<0)
+         break;
+      if (frames>0)
+         done+=frames;
+   }
+   if (err>=0 && (err=snd_pcm_delay(pcm, &delay))<0)
+      delay=0;
+   snd_pcm_drop(pcm);
+   g_free(buffer);
+   snd_pcm_close(pcm);
+
+   if (done<total) {
+      g_string_append_printf(report, "failed after %lu frames: %s\n", (gulong)done, snd_strerror(err));
+      return FALSE;
+   }
+   g_string_append_printf(report, "%u Hz, %u ch, period %lu, buffer %lu frames, delay %.1f ms, %u xruns\n",
+                           actualRate, channels, (gulong)periodSize, (gulong)bufferSize, delay*1000.0/actualRate, xruns);
+   return TRUE;
+}
+
+/* Open and run the default pcm of alsaConfig for stream with the client parameters its interface
+ * accepts: hw does no conversions, so only the device's own format and rate are tried. Through
+ * plug, dmix or dsnoop playback is tried at 44.1k and 48k in S16 and S32, capture at 48k S16.
+ * A busy device can't be opened: its config matches the running parameters and is not tested.
+ */
+static gboolean validate_stream(snd_config_t *alsaConfig, const ASCONFIG_DEVICE *device, gint interfaceType, snd_pcm_stream_t stream, GString *report) {
+   snd_pcm_format_t format=(device->defaultFormat!=SND_PCM_FORMAT_UNKNOWN) ? device->defaultFormat : ASCONFIG_DEFAULT_FORMAT;
+   guint rate=(device->defaultRate>0) ? device->defaultRate : ASCONFIG_DEFAULT_RATE;
+   guint r, f, duration;
+   gboolean valid=TRUE;
+
+   if (g_strcmp0(device->inUse, "*")==0) {
+      g_string_append_printf(report, "%s: %s is in use by %s: open test skipped\n", streamNames[stream], device->hwdev,
+                              device->owner ? device->owner : "another application");
+      return TRUE;
+   }
+   if (interfaceType==0)
+      return validate_pcm(alsaConfig, stream, rate, format, ASCONFIG_VALIDATE_TIME, report);
+   if (stream==SND_PCM_STREAM_CAPTURE)
+      return validate_pcm(alsaConfig, stream, 48000, SND_PCM_FORMAT_S16_LE, ASCONFIG_VALIDATE_TIME, report);
+   duration=ASCONFIG_VALIDATE_TIME/(G_N_ELEMENTS(validateRates)*G_N_ELEMENTS(validateFormats));
+   for (r=0; r<G_N_ELEMENTS(validateRates); r++)
+      for (f=0; f<G_N_ELEMENTS(validateFormats); f++)
+         valid&=validate_pcm(alsaConfig, stream, validateRates[r], validateFormats[f], duration, report);
+   return valid;
+}
+
+/* Load the config into a private copy of the system config, as alsa-lib will once it is
+ * written, and open and run its default pcm as clients would, see validate_stream(): playback,
+ * and capture if there is a capture device. Nothing is written, and the stream pcm is stubbed
+ * so that opening a stream default does not start the streaming command.
+ * Returns FALSE if any of them fail; report says what was negotiated, or why not.
+ */
+static gboolean validate_asoundrc(const ASCONFIG_CONFIG *config, GString *report) {
+   ASCONFIG_CONFIG stubbed=*config;
+   snd_config_t *system, *alsaConfig;
+   snd_input_t *input;
+   gboolean valid;
+   gchar *text;
+   gsize length;
+   gint err;
+
+   stubbed.stubStream=TRUE;
+   if ((text=asoundrc_text(&stubbed, &length))==NULL) {
+      g_string_append_printf(report, "Can't build the config: %s\n", strerror(errno));
+      return FALSE;
+   }
+   if ((err=snd_config_update_ref(&system))<0) {
+      free(text);
+      g_string_append_printf(report, "Can't read the system alsa config: %s\n", snd_strerror(err));
+      return FALSE;
+   }
+   err=snd_config_copy(&alsaConfig, system); /* The shared system config must not see the new config */
+   snd_config_unref(system);
+   if (err<0) {
+      free(text);
+      g_string_append_printf(report, "Can't copy the system alsa config: %s\n", snd_strerror(err));
+      return FALSE;
+   }
+   if ((err=snd_input_buffer_open(&input, text, length))>=0) {
+      err=snd_config_load(alsaConfig, input);
+      snd_input_close(input);
+   }
+   free(text);
+   if (err<0) {
+      g_string_append_printf(report, "The config does not load: %s\n", snd_strerror(err));
+      snd_config_delete(alsaConfig);
+      return FALSE;
+   }
+
+   valid=validate_stream(alsaConfig, config->playback, config->playbackInterface, SND_PCM_STREAM_PLAYBACK, report);
+   if (config->capture!=NULL)
+      valid&=validate_stream(alsaConfig, config->capture, config->captureInterface, SND_PCM_STREAM_CAPTURE, report);
+   snd_config_delete(alsaConfig);
+   return valid;
+}
+
+/* A validation run by validate_in_background() */
+typedef struct {
+   ASCONFIG_CONFIG config;
+   GString *report;
+   gboolean valid;
+   gboolean done;
+} ASCONFIG_VALIDATION;
+
+static void validation_thread(GTask *task, gpointer source_object, gpointer task_data, GCancellable *cancellable) {
+   ASCONFIG_VALIDATION *validation=task_data;
+
+   validation->valid=validate_asoundrc(&validation->config, validation->report);
+   g_task_return_boolean(task, TRUE);
+}
+
+static void validation_done(GObject *source_object, GAsyncResult *result, gpointer user_data) {
+   ASCONFIG_VALIDATION *validation=user_data;
+
+   validation->done=TRUE;
+}
+
+/* Run validate_asoundrc() in a thread: opening and running the pcms takes a couple of seconds.
+ * The window is insensitive meanwhile, as in wait_for_probe(), and the devices are referenced
+ * in case a rescan replaces their rows.
+ */
+static gboolean validate_in_background(const ASCONFIG_CONFIG *config, GString *report) {
+   ASCONFIG_VALIDATION validation={ *config, report, FALSE, FALSE };
+   GTask *task;
+
+   device_ref((ASCONFIG_DEVICE *)config->playback);
+   if (config->capture!=NULL)
+      device_ref((ASCONFIG_DEVICE *)config->capture);
+   gtk_widget_set_sensitive(window, FALSE);
+   gtk_window_set_title(GTK_WINDOW(window), "asconfig: validating the config\u2026");
+   task=g_task_new(NULL, NULL, validation_done, &validation);
+   g_task_set_task_data(task, &validation, NULL);
+   g_task_run_in_thread(task, validation_thread);
+   g_object_unref(task);
+   while ( ! validation.done)
+      g_main_context_iteration(NULL, TRUE);
+   gtk_window_set_title(GTK_WINDOW(window), "asconfig");
+   gtk_widget_set_sensitive(window, TRUE);
+   device_unref((ASCONFIG_DEVICE *)config->playback);
+   if (config->capture!=NULL)
+      device_unref((ASCONFIG_DEVICE *)config->capture);
+   return validation.valid;
+}
+
+/* Can the selected device be written to the config? As generate_check_device() for --generate,
+ * but a device in use is only matched if the user agrees. Returns FALSE, having said why, if not.
+ */
+static gboolean check_device_state(const ASCONFIG_DEVICE *device, const gchar *direction) {
+   gchar *running, *msg;
+   gint response_id;
+
+   if (g_strcmp0(device->inUse, ASCONFIG_STATE_PROBING)==0) {
+      msg=g_strdup_printf("The selected %s device is still being probed: not writing asoundrc!", direction);
+      show_msgbox(msg, "asconfig", GTK_MESSAGE_INFO);
+   }
+   else if (g_strcmp0(device->inUse, "T")==0) {
+      msg=g_strdup_printf("The selected %s device did not respond when probed: double-click it to probe again. Not writing asoundrc!", direction);
+      show_msgbox(msg, "asconfig", GTK_MESSAGE_ERROR);
+   }
+   else if (g_strcmp0(device->inUse, ASCONFIG_STATE_NOT_PROBED)==0) {
+      msg=g_strdup_printf("The selected %s device has not been probed: double-click it to probe. Not writing asoundrc!", direction);
+      show_msgbox(msg, "asconfig", GTK_MESSAGE_INFO);
+   }
+   else if (g_strcmp0(device->inUse, "*")==0) {
+      if ( ! device->running) {
+         msg=g_strdup_printf("The selected %s device is currently in use (blocked): not writing asoundrc!", direction);
+         show_msgbox(msg, "asconfig", GTK_MESSAGE_ERROR);
+      }
+      else {
+         running=device_column_text(device, VIEW_RUNNING);
+         msg=g_markup_printf_escaped("The selected %s device is in use by %s, running at\n<b>%s</b>.\nWrite a config which matches the running parameters?", direction, device->owner ? device->owner : "another application", running);
+         response_id=show_actionbox(msg, "Device in use");
+         g_free(running);
+         g_free(msg);
+         return (response_id==GTK_RESPONSE_YES);
+      }
+   }
+   else if (device->inUse!=NULL) {
+      msg=g_strdup_printf("The selected %s device could not be probed: not writing asoundrc!", direction);
+      show_msgbox(msg, "asconfig", GTK_MESSAGE_ERROR);
+   }
+   else
+      return TRUE;
+   g_free(msg);
+   return FALSE;
+}
+
+static void print_asoundrc(ASCONFIG_DEVICE_VIEW *deviceTreeview) {
+   gint playbackInterfaceType=-1, captureInterfaceType=-1;
+   gchar *asoundrc;
+   gint response_id=GTK_RESPONSE_NO;
+   FILE *asoundrcFD;
+   ASCONFIG_CONFIG config;
+   GtkTreeIter iter, captureIter;
+   GtkTreeModel *playbackModel, *captureModel;
+   GtkTreeSelection *playbackSelection, *captureSelection;
+   gboolean captureSelected;
+   gchar *msg, *escaped, *text;
+   gsize length;
+   gboolean written, exists, valid=TRUE;
+   GString *report;
+
+   //playbackModel=gtk_tree_view_get_model(GTK_TREE_VIEW(deviceTreeview->playbackTreeview));
+   playbackSelection=gtk_tree_view_get_selection(GTK_TREE_VIEW(deviceTreeview->playbackTreeview));
+
+   wait_for_probe(deviceTreeview, SND_PCM_STREAM_CAPTURE);
+   if ( ! wait_for_probe(deviceTreeview, SND_PCM_STREAM_PLAYBACK) || ! gtk_tree_selection_get_selected(playbackSelection, &playbackModel, &iter)) {
+      show_msgbox("No selected playback device: please select a playback device from the list: not writing asoundrc!", "asconfig", GTK_MESSAGE_INFO);
+      return;
+   }
+   if ( ! check_device_state(device_from_row(playbackModel, &iter), "playback"))
+      return;
+
+   playbackInterfaceType=gtk_combo_box_get_active(GTK_COMBO_BOX(asconfigControls.playbackInterface));
+   if (playbackInterfaceType==2 && ! check_mmap_access(playbackModel, &iter, "playback", "dmix", &playbackInterfaceType))
+      return;
+
+   //captureModel=gtk_tree_view_get_model(GTK_TREE_VIEW(deviceTreeview->captureTreeview));
+   captureSelection=gtk_tree_view_get_selection(GTK_TREE_VIEW(deviceTreeview->captureTreeview));
+   captureSelected=gtk_tree_selection_get_selected(captureSelection, &captureModel, &captureIter);
+   if (captureSelected==TRUE) {
+      if ( ! check_device_state(device_from_row(captureModel, &captureIter), "capture"))
+         return;
+      captureInterfaceType=gtk_combo_box_get_active(GTK_COMBO_BOX(asconfigControls.captureInterface));
+      if (captureInterfaceType==2 && ! check_mmap_access(captureModel, &captureIter, "capture", "dsnoop", &captureInterfaceType))
+         return;
+   }
+
+   config.playback=device_from_row(playbackModel, &iter);
+   config.capture=captureSelected ? device_from_row(captureModel, &captureIter) : NULL;
+   config.playbackInterface=playbackInterfaceType;
+   config.captureInterface=captureInterfaceType;
+   config.resampler=gtk_combo_box_get_active(GTK_COMBO_BOX(asconfigControls.resampler));
+   config.stream=gtk_switch_get_active(GTK_SWITCH(asconfigControls.streamSwitch));
+   config.streamDefault=gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(asconfigControls.streamDefault));
+   config.latencyProfile=gtk_combo_box_get_active(GTK_COMBO_BOX(asconfigControls.latencyProfile));
+   config.latency=gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(asconfigControls.latency));
+   config.captureLatency=gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(asconfigControls.captureLatency));
+   config.slowptr=gtk_combo_box_get_active(GTK_COMBO_BOX(asconfigControls.slowptr));
+   config.hwPtrAlignment=gtk_combo_box_get_active(GTK_COMBO_BOX(asconfigControls.hwPtrAlignment));
+   config.tstampType=gtk_combo_box_get_active(GTK_COMBO_BOX(asconfigControls.tstampType));
+   config.varPeriodsize=gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(asconfigControls.varPeriodsize));
+   config.tunedPeriodTime=gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(asconfigControls.useTunedPeriod)) ? tunedPeriodTime : 0;
+   config.stubStream=FALSE;
+
+   /* Build the config in memory and only write it once it has been seen to work */
+   text=asoundrc_text(&config, &length);
+   if (text==NULL) {
+      show_msgbox("Error building the config: not writing asoundrc!", "asconfig", GTK_MESSAGE_ERROR);
+      return;
+   }
+   report=g_string_new(NULL);
+   if (probeBackend==&mockBackend) /* Simulated cards can't be opened */
+      g_string_append(report, "Simulated devices: the config was not validated.\n");
+   else
+      valid=validate_in_background(&config, report);
+
+   /* A failed config can still be written, e.g. for hardware which is set up later */
+   asoundrc=g_build_filename(g_get_home_dir(), ".asoundrc", NULL);
+   exists=g_file_test(asoundrc, G_FILE_TEST_EXISTS);
+   escaped=g_markup_escape_text(report->str, -1);
+   if (valid)
+      msg=g_strdup_printf("%s\n%s", escaped, exists ? "User alsa config file <i>.asoundrc</i> exists. <b>Overwrite?</b>" : "<b>Write <i>.asoundrc</i>?</b>");
+   else
+      msg=g_strdup_printf("The generated config failed validation:\n\n%s\n%s", escaped,
+                           exists ? "<b>Overwrite <i>.asoundrc</i> with it anyway?</b>" : "<b>Write <i>.asoundrc</i> anyway?</b>");
+   response_id=show_actionbox(msg, valid ? "Config validated" : "Validation failed");
+   g_free(msg);
+   g_free(escaped);
+   g_string_free(report, TRUE);
+   if (response_id==GTK_RESPONSE_YES) {
+      asoundrcFD=fopen(asoundrc, "w");
+      if (asoundrcFD==NULL)
+         show_msgbox("Error opening .asoundrc for writing", "asconfig", GTK_MESSAGE_ERROR);
+      else {
+         written=(fwrite(text, 1, length, asoundrcFD)==length);
+         if (fclose(asoundrcFD)!=0 || ! written)
+            show_msgbox("Error writing .asoundrc", "asconfig", GTK_MESSAGE_ERROR);
+      }
+   }
+   g_free(asoundrc);
+   free(text);
+}
+
+/* Index of value in the NULL terminated strings, -1 if not found */
+static gint string_index(const gchar **strings, const gchar *value) {
+   gint i;
+
+   for (i=0; strings[i]!=NULL; i++)
+      if (g_strcmp0(strings[i], value)==0)
+         return i;
+   return -1;
+}
+
+/* Deep probe the devices of card into devices, as a scan of that card alone */
+static void generate_scan_card(guint card, GPtrArray *devices) {
+   ASCONFIG_SCAN *scan=scan_new(NULL, ASCONFIG_PROBE_CACHE, TRUE);
+
+   scan->card=card;
+   scan->devices=g_ptr_array_ref(devices);
+   scan_cards(scan);
+   scan_unref(scan);
+}
+
+/* The device hwdev ("hw:CARD,DEVICE") in direction stream from devices, probing its card
+ * unless it was already probed for the other direction. Returns NULL if there is no such device.
+ */
+static const ASCONFIG_DEVICE *generate_device(GPtrArray *devices, const gchar *hwdev, snd_pcm_stream_t stream) {
+   const ASCONFIG_DEVICE *device;
+   guint card, dev, i;
+   gboolean scanned=FALSE;
+
+   if (sscanf(hwdev, "hw:%u,%u", &card, &dev)!=2)
+      return NULL;
+   for (i=0; i<devices->len; i++)
+      scanned|=(((ASCONFIG_DEVICE *)g_ptr_array_index(devices, i))->card==card);
+   if ( ! scanned)
+      generate_scan_card(card, devices);
+   for (i=0; i<devices->len; i++) {
+      device=g_ptr_array_index(devices, i);
+      if (device->card==card && device->dev==dev && device->stream==stream)
+         return device;
+   }
+   return NULL;
+}
+
+/* The dialogs of print_asoundrc() as exit codes: can a config be written for device? */
+static gint generate_check_device(const ASCONFIG_DEVICE *device, const gchar *streamType, gint interfaceType, const gchar *plugin) {
+   gchar *running;
+
+   if (g_strcmp0(device->inUse, "T")==0) {
+      g_printerr("The %s device %s did not respond when probed\n", streamType, device->hwdev);
+      return ASCONFIG_EXIT_DEVICE_UNUSABLE;
+   }
+   if (g_strcmp0(device->inUse, "*")==0) {
+      if ( ! device->running) {
+         g_printerr("The %s device %s is currently in use (blocked)\n", streamType, device->hwdev);
+         return ASCONFIG_EXIT_DEVICE_UNUSABLE;
+      }
+      running=device_column_text(device, VIEW_RUNNING);
+      g_printerr("The %s device %s is in use by %s: matching its running parameters %s\n", streamType, device->hwdev,
+                  device->owner ? device->owner : "another application", running);
+      g_free(running);
+   }
+   else if (device->inUse!=NULL) {
+      g_printerr("The %s device %s could not be probed\n", streamType, device->hwdev);
+      return ASCONFIG_EXIT_DEVICE_UNUSABLE;
+   }
+   if (interfaceType==2 && device->access!=0 && ! (device->access & ASCONFIG_ACCESS_MMAP)) {
+      g_printerr("The %s device %s does not support mmap access, which %s requires: use plug instead\n", streamType, device->hwdev, plugin);
+      return ASCONFIG_EXIT_NO_MMAP;
+   }
+   return ASCONFIG_EXIT_OK;
+}
+
+/* Non-interactive config generation (--generate): the Save button without GTK.
+ * The devices are probed (or taken from the cache) and the config is written to output,
+ * "-" for stdout, or ~/.asoundrc if NULL. An existing file is only replaced with force.
+ * The config is only written once its default pcm opens and runs, unless noValidate.
+ * Returns one of the ASCONFIG_EXIT_ codes.
+ */
+static gint run_generate(const ASCONFIG_GENERATE *options) {
+   ASCONFIG_CONFIG config;
+   GPtrArray *devices;
+   gchar *asoundrc;
+   FILE *asoundrcFD=NULL;
+   const gchar *latencyProfile=options->latencyProfile;
+   GArray *results;
+   GString *validation;
+   gchar *report, *text;
+   gsize length;
+   gint status;
+
+   config.playbackInterface=options->playbackIf ? string_index(playbackInterfaceTypes, options->playbackIf) : ASCONFIG_DEFAULT_PLAYBACK_INTERFACE;
+   config.captureInterface=(options->capture==NULL) ? -1 : options->captureIf ? string_index(captureInterfaceTypes, options->captureIf) : ASCONFIG_DEFAULT_CAPTURE_INTERFACE;
+   config.resampler=options->resampler ? string_index(resamplers, options->resampler) : ASCONFIG_DEFAULT_RESAMPLER;
+   config.stream=options->stream;
+   config.streamDefault=options->streamDefault;
+   /* A target without a profile is the custom profile */
+   if (latencyProfile==NULL && options->latency>0)
+      latencyProfile="custom";
+   config.latencyProfile=latencyProfile ? string_index(latencyProfiles, latencyProfile) : ASCONFIG_DEFAULT_LATENCY_PROFILE;
+   config.latency=(options->latency>0) ? options->latency : ASCONFIG_DEFAULT_LATENCY;
+   config.captureLatency=(options->captureLatency>0) ? options->captureLatency : ASCONFIG_DEFAULT_CAPTURE_LATENCY;
+   config.slowptr=options->slowptr ? string_index(slowptrModes, options->slowptr) : 0;
+   config.hwPtrAlignment=options->hwPtrAlignment ? string_index(hwPtrAlignments, options->hwPtrAlignment) : 0;
+   config.tstampType=options->tstampType ? string_index(tstampTypes, options->tstampType) : 0;
+   config.varPeriodsize=options->varPeriodsize;
+   config.tunedPeriodTime=0;
+   config.stubStream=FALSE;
+   if (options->playback==NULL) {
+      g_printerr("--generate needs a playback device, e.g. --playback hw:0,0\n");
+      return ASCONFIG_EXIT_USAGE;
+   }
+   if (config.playbackInterface<0 || (options->capture!=NULL && config.captureInterface<0) || config.resampler<0) {
+      g_printerr("Invalid interface or resampler: playback interfaces are hw, plug and dmix, capture interfaces hw, plug and dsnoop, resamplers speexrate, speexrate_medium and speexrate_best\n");
+      return ASCONFIG_EXIT_USAGE;
+   }
+   if (config.latencyProfile<0 || options->latency<0 || options->captureLatency<0) {
+      g_printerr("Invalid latency: profiles are low-latency, balanced, power-saving and custom, with a positive --latency-ms and --capture-latency-ms\n");
+      return ASCONFIG_EXIT_USAGE;
+   }
+   if (config.slowptr<0 || config.hwPtrAlignment<0 || config.tstampType<0) {
+      g_printerr("Invalid timing option: --slowptr is default, yes or no, --hw-ptr-alignment default, no, roundup, rounddown or auto, --tstamp-type default, gettimeofday, monotonic or monotonic_raw\n");
+      return ASCONFIG_EXIT_USAGE;
+   }
+   if (options->tunePeriod) { /* Report on stderr: the config may be going to stdout */
+      results=measure_jitter(TRUE);
+      report=jitter_report(results);
+      g_printerr("%s\n", report);
+      config.tunedPeriodTime=jitter_safe_period(results);
+      g_free(report);
+      g_array_unref(results);
+   }
+
+   devices=g_ptr_array_new_with_free_func((GDestroyNotify)device_unref);
+   config.playback=generate_device(devices, options->playback, SND_PCM_STREAM_PLAYBACK);
+   config.capture=options->capture ? generate_device(devices, options->capture, SND_PCM_STREAM_CAPTURE) : NULL;
+   if (config.playback==NULL || (options->capture!=NULL && config.capture==NULL)) {
+      g_printerr("No %s device %s\n", config.playback==NULL ? "playback" : "capture", config.playback==NULL ? options->playback : options->capture);
+      g_ptr_array_unref(devices);
+      return ASCONFIG_EXIT_NO_DEVICE;
+   }
+   status=generate_check_device(config.playback, "playback", config.playbackInterface, "dmix");
+   if (status==ASCONFIG_EXIT_OK && config.capture!=NULL)
+      status=generate_check_device(config.capture, "capture", config.captureInterface, "dsnoop");
+   if (status!=ASCONFIG_EXIT_OK) {
+      g_ptr_array_unref(devices);
+      return status;
+   }
+
+   text=asoundrc_text(&config, &length);
+   if (text==NULL) {
+      g_printerr("Error building the config: %s\n", strerror(errno));
+      g_ptr_array_unref(devices);
+      return ASCONFIG_EXIT_WRITE;
+   }
+   if ( ! options->noValidate && probeBackend!=&mockBackend) { /* Report on stderr: the config may be going to stdout */
+      validation=g_string_new(NULL);
+      if ( ! validate_asoundrc(&config, validation))
+         status=ASCONFIG_EXIT_INVALID;
+      g_printerr("%s", validation->str);
+      g_string_free(validation, TRUE);
+      if (status!=ASCONFIG_EXIT_OK) {
+         g_printerr("The config failed validation: not written (--no-validate writes it anyway)\n");
+         free(text);
+         g_ptr_array_unref(devices);
+         return status;
+      }
+   }
+
+   asoundrc=(options->output!=NULL) ? g_strdup(options->output) : g_build_filename(g_get_home_dir(), ".asoundrc", NULL);
+   if (strcmp(asoundrc, "-")==0)
+      asoundrcFD=stdout;
+   else if ( ! options->force && g_file_test(asoundrc, G_FILE_TEST_EXISTS)) {
+      g_printerr("%s exists: use --force to overwrite it\n", asoundrc);
+      status=ASCONFIG_EXIT_EXISTS;
+   }
+   else if ((asoundrcFD=fopen(asoundrc, "w"))==NULL) {
+      g_printerr("Error opening %s for writing: %s\n", asoundrc, strerror(errno));
+      status=ASCONFIG_EXIT_WRITE;
+   }
+   if (status==ASCONFIG_EXIT_OK) {
+      if (fwrite(text, 1, length, asoundrcFD)!=length)
+         status=ASCONFIG_EXIT_WRITE;
+      if ((asoundrcFD==stdout ? fflush(asoundrcFD) : fclose(asoundrcFD))!=0)
+         status=ASCONFIG_EXIT_WRITE;
+      if (status!=ASCONFIG_EXIT_OK)
+         g_printerr("Error writing %s: %s\n", asoundrc, strerror(errno));
+   }
    g_free(asoundrc);
+   free(text);
+   g_ptr_array_unref(devices); /* Holds config's devices: only now are they done with */
+   if (probeTrace!=NULL)
+      trace_save(probeTrace);
+   return status;
 }
 
 static int show_actionbox(const gchar *msg, const gchar *title) {
@@ -610,29 +3858,83 @@ static void show_msgbox(const gchar *msg, const gchar *title, gint type) {
 }
 
 static void refresh_clicked(GtkToolItem *item,  ASCONFIG_DEVICE_VIEW *deviceTreeview) {
-   GtkTreeModel *model=gtk_tree_view_get_model (GTK_TREE_VIEW(deviceTreeview->playbackTreeview));
-   gtk_list_store_clear(GTK_LIST_STORE(model));
-   scancards(SND_PCM_STREAM_PLAYBACK, GTK_LIST_STORE(model));
+   start_scan(deviceTreeview, FALSE); /* Force a full re-probe */
+}
+
+/* Selecting a device which has not been probed probes it, unless scanning is passive */
+static void device_selected(GtkTreeSelection *selection, ASCONFIG_DEVICE_VIEW *deviceTreeview) {
+   GtkTreeModel *model;
+   GtkTreeIter iter;
+
+   if (passiveProbe || ! gtk_tree_selection_get_selected(selection, &model, &iter))
+      return;
+   if (g_strcmp0(device_from_row(model, &iter)->inUse, ASCONFIG_STATE_NOT_PROBED)==0)
+      start_device_probe(deviceTreeview, GTK_WIDGET(gtk_tree_selection_get_tree_view(selection))==deviceTreeview->playbackTreeview ? SND_PCM_STREAM_PLAYBACK : SND_PCM_STREAM_CAPTURE, &iter);
+}
+
+/* Double-click or Enter on a device probes it */
+static void device_activated(GtkTreeView *treeview, GtkTreePath *path, GtkTreeViewColumn *column, ASCONFIG_DEVICE_VIEW *deviceTreeview) {
+   GtkTreeIter iter;
 
-   model=gtk_tree_view_get_model (GTK_TREE_VIEW(deviceTreeview->captureTreeview));
-   gtk_list_store_clear(GTK_LIST_STORE(model));
-   scancards(SND_PCM_STREAM_CAPTURE, GTK_LIST_STORE(model));
+   if (gtk_tree_model_get_iter(gtk_tree_view_get_model(treeview), &iter, path))
+      start_device_probe(deviceTreeview, GTK_WIDGET(treeview)==deviceTreeview->playbackTreeview ? SND_PCM_STREAM_PLAYBACK : SND_PCM_STREAM_CAPTURE, &iter);
 }
 
 static void save_clicked(GtkToolItem *item, ASCONFIG_DEVICE_VIEW *deviceTreeview) {
    print_asoundrc(deviceTreeview);
 }
 
+/* Cells are rendered from the row's device when drawn, rather than stored as text */
+static void device_cell_data(GtkTreeViewColumn *column, GtkCellRenderer *renderer, GtkTreeModel *model, GtkTreeIter *iter, gpointer data) {
+   gchar *text=device_column_text(device_from_row(model, iter), GPOINTER_TO_UINT(data));
+
+   g_object_set(renderer, "text", text, NULL);
+   g_free(text);
+}
+
+/* Sort by the column's text, numbers in numeric order, then by card and device */
+static gint device_compare(GtkTreeModel *model, GtkTreeIter *a, GtkTreeIter *b, gpointer data) {
+   const ASCONFIG_DEVICE *deviceA=device_from_row(model, a), *deviceB=device_from_row(model, b);
+   gchar *textA=device_column_text(deviceA, GPOINTER_TO_UINT(data));
+   gchar *textB=device_column_text(deviceB, GPOINTER_TO_UINT(data));
+   gchar *keyA=g_utf8_collate_key_for_filename(textA ? textA : "", -1);
+   gchar *keyB=g_utf8_collate_key_for_filename(textB ? textB : "", -1);
+   gint result=strcmp(keyA, keyB);
+
+   if (result==0)
+      result=(deviceA->card!=deviceB->card) ? (gint)deviceA->card-(gint)deviceB->card : (gint)deviceA->dev-(gint)deviceB->dev;
+   g_free(keyA);
+   g_free(keyB);
+   g_free(textA);
+   g_free(textB);
+   return result;
+}
+
+/* Interactive search: a row matches on its card number, ID or name, or its hw path. Returns FALSE on a match */
+static gboolean device_search(GtkTreeModel *model, gint column, const gchar *key, GtkTreeIter *iter, gpointer data) {
+   const ASCONFIG_DEVICE *device=device_from_row(model, iter);
+   gchar *card=g_strdup_printf("%u", device->card);
+   gboolean match;
+
+   match=g_str_has_prefix(card, key) || g_str_has_prefix(device->hwdev, key) ||
+         (device->cardInfo!=NULL && (g_ascii_strncasecmp(device->cardInfo->ID, key, strlen(key))==0 ||
+                                     g_ascii_strncasecmp(device->cardInfo->name, key, strlen(key))==0));
+   g_free(card);
+   return ! match;
+}
+
 static void add_columns(GtkTreeView *treeview) {
+   GtkTreeSortable *sortable=GTK_TREE_SORTABLE(gtk_tree_view_get_model(treeview));
    GtkCellRenderer *renderer;
    GtkTreeViewColumn *column;
    guint i;
-   const gchar *columnHeadings[]={ "","Card number","Card ID","Card name","Device number","Device ID","Device name","Min. channels","Max. channels","Min. Rate","Max. rate","Sample formats","Alsa HW path" };
    //  GtkTreeModel *model = gtk_tree_view_get_model (treeview);
 
-   for (i=0; i<NUM_COLUMNS-3; i++) { /* Last 3 columns are hidden */
+   for (i=0; i<NUM_VIEW_COLUMNS; i++) {
       renderer=gtk_cell_renderer_text_new();
-      column=gtk_tree_view_column_new_with_attributes(columnHeadings[i], renderer, "text", i, NULL);
+      column=gtk_tree_view_column_new_with_attributes(viewHeadings[i], renderer, NULL);
+      gtk_tree_view_column_set_cell_data_func(column, renderer, device_cell_data, GUINT_TO_POINTER(i), NULL);
+      gtk_tree_sortable_set_sort_func(sortable, i, device_compare, GUINT_TO_POINTER(i), NULL);
       gtk_tree_view_column_set_sort_column_id(column, i);
       gtk_tree_view_append_column(treeview, column);
    }
@@ -689,6 +3991,21 @@ static GtkWidget *addCheck(const gchar *heading, GtkWidget *gbox, gint left, gin
    return checkControl;
 }
 
+static GtkWidget *addSpin(const gchar *heading, gdouble min, gdouble max, GtkWidget *gbox, gint left, gint top) {
+   GtkWidget *spinControl=NULL;
+   GtkWidget *label;
+
+   label=gtk_label_new(heading);
+   gtk_grid_attach (GTK_GRID (gbox), label, left, top, 1, 1);
+
+   spinControl=gtk_spin_button_new_with_range(min, max, 1);
+   if (spinControl==NULL) return NULL;
+
+   gtk_grid_attach (GTK_GRID (gbox), spinControl, left+1, top, 1, 1);
+
+   return spinControl;
+}
+
 static void addToolbar(GtkWidget *gbox, ASCONFIG_DEVICE_VIEW *deviceTreeview) {
    GtkWidget *tool_bar;
    GtkToolItem *toolButton;
@@ -743,13 +4060,68 @@ static gboolean streamSwitchState(GtkSwitch *widget, gboolean state, gpointer us
    return FALSE;
 }
 
+/* The latency profile only sizes dmix; the target is only used by the custom profile */
+static void latencyProfileChanged(GtkComboBox *widget, gpointer user_data) {
+   gboolean dmix=(gtk_combo_box_get_active(GTK_COMBO_BOX(asconfigControls.playbackInterface))==2);
+   gint profile=gtk_combo_box_get_active(GTK_COMBO_BOX(asconfigControls.latencyProfile));
+
+   gtk_widget_set_sensitive(GTK_WIDGET(asconfigControls.latencyProfile), dmix);
+   gtk_widget_set_sensitive(GTK_WIDGET(asconfigControls.latency), dmix && profile>=0 && latencyProfileTimes[profile]==0);
+}
+
+/* The timing options are used by dmix and dsnoop */
+static void timingControlsState(void) {
+   gboolean dmix=(gtk_combo_box_get_active(GTK_COMBO_BOX(asconfigControls.playbackInterface))==2);
+   gboolean dsnoop=(gtk_combo_box_get_active(GTK_COMBO_BOX(asconfigControls.captureInterface))==2);
+
+   gtk_widget_set_sensitive(GTK_WIDGET(asconfigControls.timing), dmix || dsnoop);
+}
+
+/* The capture latency only sizes dsnoop */
+static void captureInterfaceChanged(GtkComboBox *widget, gpointer user_data) {
+   gtk_widget_set_sensitive(GTK_WIDGET(asconfigControls.captureLatency), gtk_combo_box_get_active(GTK_COMBO_BOX(asconfigControls.captureInterface))==2);
+   timingControlsState();
+}
+
 static void playbackInterfaceChanged(GtkComboBox *widget, gpointer user_data) {
     streamSwitchState(NULL, gtk_switch_get_active(GTK_SWITCH(asconfigControls.streamSwitch)), NULL);
+    latencyProfileChanged(NULL, NULL);
+    timingControlsState();
+}
+
+static void jitter_thread(GTask *task, gpointer source_object, gpointer task_data, GCancellable *cancellable) {
+   g_task_return_pointer(task, measure_jitter(FALSE), (GDestroyNotify)g_array_unref);
+}
+
+static void jitter_done(GObject *source_object, GAsyncResult *result, gpointer user_data) {
+   GArray *results=g_task_propagate_pointer(G_TASK(result), NULL);
+   gchar *report=jitter_report(results);
+
+   tunedPeriodTime=jitter_safe_period(results);
+   gtk_widget_set_sensitive(asconfigControls.useTunedPeriod, tunedPeriodTime>0);
+   if (tunedPeriodTime==0)
+      gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(asconfigControls.useTunedPeriod), FALSE);
+   gtk_button_set_label(GTK_BUTTON(asconfigControls.measureJitter), "Measure jitter");
+   gtk_widget_set_sensitive(asconfigControls.measureJitter, TRUE);
+   show_msgbox(report, "Scheduling jitter", GTK_MESSAGE_INFO);
+   g_free(report);
+   g_array_unref(results);
+}
+
+/* Time the candidate periods in the background: takes up to ASCONFIG_JITTER_TIME */
+static void measureJitterClicked(GtkButton *button, gpointer user_data) {
+   GTask *task;
+
+   gtk_widget_set_sensitive(GTK_WIDGET(button), FALSE);
+   gtk_button_set_label(button, "Measuring\u2026");
+   task=g_task_new(NULL, NULL, jitter_done, NULL);
+   g_task_run_in_thread(task, jitter_thread);
+   g_object_unref(task);
 }
 
 static GtkWidget *addControls(GtkWidget *windowVBox) {
-   GtkWidget *controlGrid;
-   int i=0;
+   GtkWidget *controlGrid, *timingGrid;
+   int i=0, j=0;
 
    controlGrid=gtk_grid_new();
    gtk_grid_set_row_spacing(GTK_GRID (controlGrid), 4);
@@ -759,13 +4131,43 @@ static GtkWidget *addControls(GtkWidget *windowVBox) {
 
    asconfigControls.resampler=addCombo(resamplers, "Resampler:", controlGrid, 0, i++);
    asconfigControls.playbackInterface=addCombo(playbackInterfaceTypes, "Playback interface:", controlGrid, 0, i++);
-   asconfigControls.captureInterface=addCombo(captureInterfaceTypes, "Capture interface:", controlGrid, 0, i++);
+   asconfigControls.captureInterface=addCombo(captureInterfaceTypes, "Capture interface:", controlGrid, 0, i);
+   asconfigControls.captureLatency=addSpin("Capture buffer (ms):", 1, 2000, controlGrid, 2, i++);
+   /* The measured period replaces the latencies when sizing dmix and dsnoop */
+   gtk_grid_attach(GTK_GRID (controlGrid), gtk_label_new("Scheduling jitter:"), 0, i, 1, 1);
+   asconfigControls.measureJitter=gtk_button_new_with_label("Measure jitter");
+   gtk_grid_attach(GTK_GRID (controlGrid), asconfigControls.measureJitter, 1, i, 1, 1);
+   asconfigControls.useTunedPeriod=addCheck("Use measured period:", controlGrid, 2, i++);
+   gtk_widget_set_sensitive(asconfigControls.useTunedPeriod, FALSE);
+
+   /* dmix and dsnoop timing: "default" slowptr and hw_ptr_alignment follow the probed device */
+   asconfigControls.timing=gtk_expander_new("Advanced timing (dmix / dsnoop)");
+   gtk_grid_attach(GTK_GRID (controlGrid), asconfigControls.timing, 0, i++, 4, 1);
+   timingGrid=gtk_grid_new();
+   gtk_grid_set_row_spacing(GTK_GRID (timingGrid), 4);
+   gtk_grid_set_column_spacing(GTK_GRID (timingGrid), 4);
+   gtk_container_set_border_width(GTK_CONTAINER (timingGrid), 4);
+   gtk_container_add(GTK_CONTAINER(asconfigControls.timing), timingGrid);
+   asconfigControls.slowptr=addCombo(slowptrModes, "slowptr:", timingGrid, 0, j);
+   asconfigControls.hwPtrAlignment=addCombo(hwPtrAlignments, "hw_ptr_alignment:", timingGrid, 2, j++);
+   asconfigControls.tstampType=addCombo(tstampTypes, "tstamp_type:", timingGrid, 0, j);
+   asconfigControls.varPeriodsize=addCheck("var_periodsize:", timingGrid, 2, j++);
    asconfigControls.streamSwitch=addSwitch("Add stream pcm:", controlGrid, 0, i);
    asconfigControls.streamDefault=addCheck("Stream is default:", controlGrid, 2, i++);
+   asconfigControls.latencyProfile=addCombo(latencyProfiles, "Playback latency:", controlGrid, 0, i);
+   asconfigControls.latency=addSpin("Buffer (ms):", 1, 2000, controlGrid, 2, i++);
    
    gtk_combo_box_set_active(GTK_COMBO_BOX(asconfigControls.resampler), ASCONFIG_DEFAULT_RESAMPLER);
    gtk_combo_box_set_active(GTK_COMBO_BOX(asconfigControls.playbackInterface), ASCONFIG_DEFAULT_PLAYBACK_INTERFACE);
    gtk_combo_box_set_active(GTK_COMBO_BOX(asconfigControls.captureInterface), ASCONFIG_DEFAULT_CAPTURE_INTERFACE);
+   gtk_combo_box_set_active(GTK_COMBO_BOX(asconfigControls.latencyProfile), ASCONFIG_DEFAULT_LATENCY_PROFILE);
+   gtk_spin_button_set_value(GTK_SPIN_BUTTON(asconfigControls.latency), ASCONFIG_DEFAULT_LATENCY);
+   latencyProfileChanged(NULL, NULL);
+   gtk_spin_button_set_value(GTK_SPIN_BUTTON(asconfigControls.captureLatency), ASCONFIG_DEFAULT_CAPTURE_LATENCY);
+   gtk_combo_box_set_active(GTK_COMBO_BOX(asconfigControls.slowptr), 0);
+   gtk_combo_box_set_active(GTK_COMBO_BOX(asconfigControls.hwPtrAlignment), 0);
+   gtk_combo_box_set_active(GTK_COMBO_BOX(asconfigControls.tstampType), 0);
+   captureInterfaceChanged(NULL, NULL);
 
    gtk_switch_set_active(GTK_SWITCH(asconfigControls.streamSwitch), FALSE);
    streamSwitchState(NULL, gtk_switch_get_active(GTK_SWITCH(asconfigControls.streamSwitch)), NULL);
@@ -773,32 +4175,15 @@ static GtkWidget *addControls(GtkWidget *windowVBox) {
    return windowVBox;
 }
 
-GtkWidget *addTreeview(GtkWidget *vbox, snd_pcm_stream_t stream) {
+GtkWidget *addTreeview(GtkWidget *vbox) {
    GtkWidget *treeview;
    GtkListStore *store;
    GtkWidget *sw;
 
-   store=gtk_list_store_new(NUM_COLUMNS,
-                              G_TYPE_STRING,
-                              G_TYPE_UINT,
-                              G_TYPE_STRING,
-                              G_TYPE_STRING,
-                              G_TYPE_UINT,
-                              G_TYPE_STRING,
-                              G_TYPE_STRING,
-                              G_TYPE_UINT,
-                              G_TYPE_UINT,
-                              G_TYPE_UINT,
-                              G_TYPE_UINT,
-                              G_TYPE_STRING,
-                              G_TYPE_STRING,
-                              G_TYPE_UINT,
-                              G_TYPE_STRING,
-                              G_TYPE_UINT);
-
-   scancards(stream, store);
+   store=gtk_list_store_new(NUM_COLUMNS, device_get_type());
+
    treeview=gtk_tree_view_new_with_model(GTK_TREE_MODEL(store));
-   gtk_tree_view_set_search_column (GTK_TREE_VIEW(treeview), COLUMN_CARD);
+   gtk_tree_view_set_search_equal_func(GTK_TREE_VIEW(treeview), device_search, NULL, NULL);
    g_object_unref(GTK_TREE_MODEL(store));
    add_columns(GTK_TREE_VIEW(treeview));
 
@@ -815,8 +4200,76 @@ int main(int argc, char **argv) {
    GtkWidget *vbox;
    GtkWidget *label;
    ASCONFIG_DEVICE_VIEW deviceTreeview;
+   GError *error=NULL;
+   GOptionContext *context;
+   gchar *traceFilename=NULL, *mockSize=NULL;
+   gboolean bench=FALSE, probe=FALSE, csv=FALSE;
+   gboolean generate=FALSE, jitter=FALSE;
+   ASCONFIG_GENERATE generateOptions={ NULL };
+   GOptionEntry options[]={
+      { "passive", 'p', 0, G_OPTION_ARG_NONE, &passiveProbe, "Don't open pcm devices when scanning: read /proc/asound only", NULL },
+      { "probe-timeout", 't', 0, G_OPTION_ARG_INT, &probeTimeout, "Give up probing a device after MS milliseconds (0: wait forever)", "MS" },
+      { "trace", 0, 0, G_OPTION_ARG_FILENAME, &traceFilename, "Write the probe timings to FILE as Chrome trace-event JSON", "FILE" },
+      { "mock", 0, 0, G_OPTION_ARG_STRING, &mockSize, "Probe simulated cards instead of the sound hardware, e.g. 4x2", "CARDSxDEVICES" },
+      { "mock-latency", 0, 0, G_OPTION_ARG_INT, &mockConfig.latency, "Simulated pcm open time in milliseconds", "MS" },
+      { "mock-busy", 0, 0, G_OPTION_ARG_INT, &mockConfig.busy, "Percentage of simulated pcms which are busy", "PERCENT" },
+      { "mock-error", 0, 0, G_OPTION_ARG_INT, &mockConfig.error, "Percentage of simulated pcms which fail to open", "PERCENT" },
+      { "bench", 0, 0, G_OPTION_ARG_NONE, &bench, "Time full scans of 1, 16, 64 and 256 simulated devices and exit", NULL },
+      { "probe", 0, 0, G_OPTION_ARG_NONE, &probe, "Scan the cards, print the devices as JSON and exit, without a display", NULL },
+      { "csv", 0, 0, G_OPTION_ARG_NONE, &csv, "With --probe: print CSV with the device list columns instead", NULL },
+      { "jitter", 0, 0, G_OPTION_ARG_NONE, &jitter, "Measure this host's scheduling jitter, print the smallest safe period and exit", NULL },
+      { "generate", 0, 0, G_OPTION_ARG_NONE, &generate, "Write the config for --playback and --capture without a display and exit", NULL },
+      { "playback", 0, 0, G_OPTION_ARG_STRING, &generateOptions.playback, "With --generate: the playback device", "hw:CARD,DEVICE" },
+      { "capture", 0, 0, G_OPTION_ARG_STRING, &generateOptions.capture, "With --generate: the capture device, if any", "hw:CARD,DEVICE" },
+      { "playback-if", 0, 0, G_OPTION_ARG_STRING, &generateOptions.playbackIf, "With --generate: playback interface hw, plug or dmix", "IF" },
+      { "capture-if", 0, 0, G_OPTION_ARG_STRING, &generateOptions.captureIf, "With --generate: capture interface hw, plug or dsnoop", "IF" },
+      { "resampler", 0, 0, G_OPTION_ARG_STRING, &generateOptions.resampler, "With --generate: speexrate, speexrate_medium or speexrate_best", "NAME" },
+      { "stream", 0, 0, G_OPTION_ARG_NONE, &generateOptions.stream, "With --generate: add the stream pcm", NULL },
+      { "stream-default", 0, 0, G_OPTION_ARG_NONE, &generateOptions.streamDefault, "With --generate: make the stream pcm the default", NULL },
+      { "latency", 0, 0, G_OPTION_ARG_STRING, &generateOptions.latencyProfile, "With --generate: dmix latency profile low-latency, balanced, power-saving or custom", "PROFILE" },
+      { "latency-ms", 0, 0, G_OPTION_ARG_INT, &generateOptions.latency, "With --generate: buffer latency of the custom profile in milliseconds", "MS" },
+      { "capture-latency-ms", 0, 0, G_OPTION_ARG_INT, &generateOptions.captureLatency, "With --generate: dsnoop buffer latency in milliseconds", "MS" },
+      { "slowptr", 0, 0, G_OPTION_ARG_STRING, &generateOptions.slowptr, "With --generate: dmix/dsnoop slowptr default, yes or no", "MODE" },
+      { "hw-ptr-alignment", 0, 0, G_OPTION_ARG_STRING, &generateOptions.hwPtrAlignment, "With --generate: dmix/dsnoop hw_ptr_alignment default, no, roundup, rounddown or auto", "MODE" },
+      { "tstamp-type", 0, 0, G_OPTION_ARG_STRING, &generateOptions.tstampType, "With --generate: dmix/dsnoop tstamp_type default, gettimeofday, monotonic or monotonic_raw", "TYPE" },
+      { "var-periodsize", 0, 0, G_OPTION_ARG_NONE, &generateOptions.varPeriodsize, "With --generate: let dmix/dsnoop clients use other period sizes than the slave", NULL },
+      { "tune-period", 0, 0, G_OPTION_ARG_NONE, &generateOptions.tunePeriod, "With --generate: measure the scheduling jitter and size dmix/dsnoop from the smallest safe period", NULL },
+      { "no-validate", 0, 0, G_OPTION_ARG_NONE, &generateOptions.noValidate, "With --generate: write the config without first opening and running its default pcm", NULL },
+      { "output", 'o', 0, G_OPTION_ARG_FILENAME, &generateOptions.output, "With --generate: write to FILE (- for stdout) instead of ~/.asoundrc", "FILE" },
+      { "force", 'f', 0, G_OPTION_ARG_NONE, &generateOptions.force, "With --generate: overwrite an existing file", NULL },
+      { NULL }
+   };
 
-   gtk_init(NULL, NULL);
+   /* GTK is only initialised once it is known to be needed: --bench, --probe, --jitter and --generate run headless */
+   context=g_option_context_new(NULL);
+   g_option_context_add_main_entries(context, options, NULL);
+   g_option_context_set_ignore_unknown_options(context, TRUE); /* GTK's own options */
+   if ( ! g_option_context_parse(context, &argc, &argv, &error)) {
+      g_printerr("%s\n", error->message);
+      g_error_free(error);
+      return 1;
+   }
+   g_option_context_free(context);
+   if (traceFilename!=NULL)
+      probeTrace=trace_new(traceFilename);
+   probeBackend=&alsaBackend;
+   if (mockSize!=NULL) {
+      if (sscanf(mockSize, "%ux%u", &mockConfig.cards, &mockConfig.devices)!=2) {
+         g_printerr("Invalid --mock size %s: expected CARDSxDEVICES, e.g. 4x2\n", mockSize);
+         return 1;
+      }
+      probeBackend=&mockBackend;
+   }
+   if (bench)
+      return run_bench();
+   if (probe)
+      return run_probe(csv);
+   if (jitter)
+      return run_jitter();
+   if (generate)
+      return run_generate(&generateOptions);
+
+   gtk_init(&argc, &argv);
    
    /* create window, etc */
    window=gtk_window_new(GTK_WINDOW_TOPLEVEL);
@@ -824,25 +4277,28 @@ int main(int argc, char **argv) {
 
    gtk_container_set_border_width(GTK_CONTAINER(window), 8);
 
-   snd_ctl_card_info_alloca(&info);
-   snd_pcm_info_alloca(&pcminfo);
-   snd_pcm_hw_params_alloca(&pars);
-   snd_pcm_format_mask_alloca(&fmask);
-
    vbox=gtk_box_new(GTK_ORIENTATION_VERTICAL, 8);
    gtk_container_add(GTK_CONTAINER (window), vbox);
    addToolbar(vbox, &deviceTreeview);
 
    label=gtk_label_new("Select playback device:");
    gtk_box_pack_start(GTK_BOX (vbox), label, FALSE, TRUE, 0);
-   deviceTreeview.playbackTreeview=addTreeview(vbox, SND_PCM_STREAM_PLAYBACK);
+   deviceTreeview.playbackTreeview=addTreeview(vbox);
    label=gtk_label_new("Select capture device:");
    gtk_box_pack_start(GTK_BOX (vbox), label, FALSE, TRUE, 0);
-   deviceTreeview.captureTreeview=addTreeview(vbox, SND_PCM_STREAM_CAPTURE);
+   deviceTreeview.captureTreeview=addTreeview(vbox);
    
+   g_signal_connect(deviceTreeview.playbackTreeview, "row-activated", G_CALLBACK(device_activated), &deviceTreeview);
+   g_signal_connect(deviceTreeview.captureTreeview, "row-activated", G_CALLBACK(device_activated), &deviceTreeview);
+   g_signal_connect(gtk_tree_view_get_selection(GTK_TREE_VIEW(deviceTreeview.playbackTreeview)), "changed", G_CALLBACK(device_selected), &deviceTreeview);
+   g_signal_connect(gtk_tree_view_get_selection(GTK_TREE_VIEW(deviceTreeview.captureTreeview)), "changed", G_CALLBACK(device_selected), &deviceTreeview);
+
    addControls(vbox);
    g_signal_connect(GTK_COMBO_BOX(asconfigControls.playbackInterface), "changed", G_CALLBACK(playbackInterfaceChanged), NULL);
    g_signal_connect(GTK_SWITCH(asconfigControls.streamSwitch), "state-set", G_CALLBACK(streamSwitchState), NULL);
+   g_signal_connect(GTK_COMBO_BOX(asconfigControls.latencyProfile), "changed", G_CALLBACK(latencyProfileChanged), NULL);
+   g_signal_connect(GTK_COMBO_BOX(asconfigControls.captureInterface), "changed", G_CALLBACK(captureInterfaceChanged), NULL);
+   g_signal_connect(GTK_BUTTON(asconfigControls.measureJitter), "clicked", G_CALLBACK(measureJitterClicked), NULL);
 
    g_signal_connect(window, "destroy", G_CALLBACK(gtk_main_quit), NULL);
 
@@ -850,7 +4306,20 @@ int main(int argc, char **argv) {
    gtk_window_set_default_size (GTK_WINDOW (window), 280, 250);
 
    gtk_widget_show_all (window);
+   start_scan(&deviceTreeview, ASCONFIG_PROBE_CACHE);
+   if (probeBackend==&alsaBackend)
+      hotplug_init(&deviceTreeview);
    gtk_main();
 
+   if (currentScan!=NULL)
+      g_cancellable_cancel(currentScan->cancellable);
+   if (hotplugMonitor!=NULL)
+      g_object_unref(hotplugMonitor);
+   if (hotplugCards!=NULL)
+      g_hash_table_destroy(hotplugCards);
+   if (probeTrace!=NULL) /* Not freed: a timed out probe thread may still record into it */
+      trace_save(probeTrace);
+   g_free(traceFilename);
+
   return 0;
 }